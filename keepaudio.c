@@ -5,47 +5,175 @@
 // Features:
 //   --freq F_HZ
 //   --db NEG_DBFS
-//   --rate SR
-//   --device N
+//   --rate SR|min            (min = lowest rate, mono, pcm16 the endpoint accepts)
+//   --device N|N,M,...|all   (one worker drives every listed output)
+//   --device-id ID           (pick the endpoint by its MMDevice ID; stable across hot-plug)
+//   --device-name TEXT       (first active endpoint whose friendly name contains TEXT)
+//   --profiles PATH|none     (per-device INI profiles; default %ProgramData%\KeepAudio\profiles.ini)
 //   --channels 1|2
 //   --frames PER_BUFFER
 //   --buffers K
 //   --format auto|pcm16|float32
+//   --synth auto|lut|sine|pulse (lut = one precomputed period copied into each buffer;
+//                            pulse = digital zero plus a 1 ms blip every --interval)
+//   --interval MS            (pulse spacing; default: the calibrated value for the device, else 1000)
+//   --calibrate              (pulse mode, console: find the longest interval that keeps the device awake)
+//   --kernel auto|scalar|sse2|avx2 (synthesis kernel when no table is used; auto = CPUID)
+//   --static                 (pick --frames/--buffers that tile the period; never refill)
+//   --lock-memory            (VirtualLock the winmm buffer arena so it cannot be paged out)
+//   --adaptive               (winmm: grow the buffer queue when refills run late, shrink it when idle)
+//   --mmcss                  (register the worker with MMCSS "Audio"; falls back to a high thread priority)
+//   --eco                    (EcoQoS: power-throttle the process onto efficiency cores; >= 16 buffers)
+//   --backend winmm|wasapi   (wasapi = event-driven shared-mode IAudioClient)
+//   --exclusive              (WASAPI exclusive mode in the device's native format; implies wasapi)
+//   --min-period             (WASAPI minimum period: IAudioClient3 shared, or with --exclusive the
+//                             device minimum; implies wasapi)
+//   --duty-cycle [--grace MS] (pause while other apps play on the endpoint; resume MS after they stop)
+//   --stats [SECONDS]        (log refill/underrun counters every SECONDS, default 10, and at exit)
+//   --power-policy always|ac|display|ac-or-display (when to keep the device awake; streams
+//                            are always closed for sleep and rebuilt on resume)
+//   --lean                   (after setup: free argv, trim the working set, low memory priority)
+//   --bench [SECONDS]        (time the fill kernels, then run the worker loop and report its cost)
+//   --soak [HOURS]           (offline: fill HOURS of simulated playback per path and case, default 1;
+//                             check drift, seams and throughput, exit code 1 on regression)
+//   --soak-rebaseline        (with --soak: record this run's throughput as the new baseline)
+//   --soak-baseline FILE     (with --soak: baselines from/to an INI file instead of HKCU, for CI)
 //   --chance PERCENT         (1..100) random early exit before opening audio
+//   --standalone             (run separately even if another instance is already running)
+//   --control CMD [VALUE]    (send set-level DB, set-frequency HZ, pause, resume or dump-stats
+//                             to the running instance; the stream stays open)
 //   --list-devices           (shows a MessageBox with the device list; or console if --console)
+//   --list-devices --json    (endpoint IDs, mix formats, periods and --rate min picks as JSON on stdout)
 //   --install [--install-copy] [--startup-name Name]
 //   --uninstall [--startup-name Name]
+//   --install-service [--startup-name Name] (admin: one LocalService instance for the whole
+//                            machine, started before logon and restarted by the SCM on failure)
+//   --uninstall-service [--startup-name Name]
 //   --console                (attach a console and print logs/debug messages)
 //
 // Build (MSVC):
-//   cl /O2 /W4 keepaudio.c /link winmm.lib /SUBSYSTEM:WINDOWS /ENTRY:WinMainCRTStartup
+//   cl /O2 /W4 keepaudio.c /link winmm.lib ole32.lib /SUBSYSTEM:WINDOWS /ENTRY:WinMainCRTStartup
 //
 // Build (MinGW):
-//   gcc -O2 keepaudio.c -lwinmm -o keepaudio.exe -mwindows
+//   gcc -O2 keepaudio.c -lwinmm -lole32 -o keepaudio.exe -mwindows
 //
 // Notes:
 // - When started at logon via HKCU\...\Run, this build produces no window.
 // - --list-devices without --console shows a simple MessageBox listing devices.
 // - Logs go to OutputDebugString by default (view with DebugView). With --console
 //   we allocate a console and print there.
+// - ETW: TraceLogging provider "KeepAudio" {43623EAA-BEFF-43FA-8AA8-25EA033C233F} with buffer
+//   submit/done/late events, device open/close (negotiated format) and the shutdown reason.
+//   When no session is listening each event is a single enabled check.
+// - The audio worker blocks on a winmm completion event (CALLBACK_EVENT) and only
+//   wakes when a buffer finishes, i.e. roughly once per --frames period.
+// - --backend wasapi skips the winmm emulation layer; the worker waits on the
+//   IAudioClient event (one wakeup per engine period) and tops up GetBuffer space.
+//   --device N then counts active render endpoints in MMDevice order (see --list-devices).
+// - An IMMNotificationClient watches endpoints: a stream whose device is unplugged is
+//   reopened as soon as that endpoint (matched by ID) is back, and default-device
+//   streams follow default changes. Reconnect timing is logged.
+// - --duty-cycle polls the endpoint's sessions (IAudioSessionManager2 + peak meter) once a
+//   second; while another process is audible the stream is paused (waveOutPause /
+//   IAudioClient_Stop), since the device is being kept awake anyway.
+// - The main thread blocks in MsgWaitForMultipleObjectsEx on the shutdown event and the
+//   worker handle, so with nothing to do it never wakes. A hidden (never shown) top-level
+//   window receives WM_ENDSESSION at logoff/shutdown.
+// - One instance per logon session: a later start (a second Run entry, a manual launch) hands
+//   its device and tone options over the pipe \\.\pipe\KeepAudio.<session> and exits; the
+//   running instance adds those streams to its worker unless it already drives the endpoint.
+// - With the service installed, user starts hand over to it instead (\\.\pipe\KeepAudio.Service,
+//   open to interactive users), so one process covers every session. From a client that is
+//   not SYSTEM or an elevated administrator the service takes only device and tone flags, and
+//   no --control command except dump-stats. The service gets
+//   logoff-independent shutdown, sleep and display/AC changes from the SCM, not a window.
+//   --control uses the same pipe. Level and frequency changes reach the queued buffers as
+//   they are refilled, starting from the phase the old tone had reached, so there is no pop.
+// - Counters (late refills, refill latency, wakeups, frames) are published about once a
+//   second to the shared-memory block Local\KeepAudio.Stats.<pid> (KeepAudioStats below),
+//   so a monitor can read them without attaching to the process.
+// - Profiles: each [section] of the profiles file names one endpoint (MMDevice ID, or a
+//   friendly-name fragment) and sets per-stream flags without the dashes (db = -90, synth =
+//   pulse, rate, frames, buffers, backend, ...), layered over the command line. The streams
+//   follow edits live: the directory is watched with ReadDirectoryChangesW; a level or frequency
+//   change retunes in place, anything else reopens that one stream. A file that accounts
+//   other than SYSTEM, Administrators or our own could write is ignored; --install-service
+//   creates the default directory admin-writable only.
+// - Teardown never polls: after waveOutReset the close waits on the stream's completion event
+//   for at most one buffer period, and every winmm device is reset before any is drained.
+//   Close times are logged on reopen, in --stats and the stats block, and as ETW DeviceClose /
+//   Teardown events.
 
 #define _CRT_SECURE_NO_WARNINGS
 #define _USE_MATH_DEFINES
+#define COBJMACROS
 #include <windows.h>
 #include <mmsystem.h>
 #include <mmreg.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <audiopolicy.h>
 #include <shellapi.h>
+#include <sddl.h>
+#define PSAPI_VERSION 2 // K32* entry points in kernel32; no psapi.lib needed
+#include <psapi.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
 #include <stdbool.h>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define KA_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KA_TARGET_SSE2
+#define KA_TARGET_AVX2
+#else
+#include <cpuid.h>
+// Let GCC/Clang emit SSE2/AVX2 for these functions only; the rest stays baseline.
+#define KA_TARGET_SSE2 __attribute__((target("sse2")))
+#define KA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 #pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "ole32.lib")
+
+// TraceLoggingProvider.h ships with the Windows SDK; without it (older MinGW) KA_TRACE compiles
+// to nothing.
+#if defined(__has_include)
+#if __has_include(<TraceLoggingProvider.h>)
+#define KA_HAVE_TRACELOGGING
+#endif
+#elif defined(_MSC_VER)
+#define KA_HAVE_TRACELOGGING
+#endif
+#ifdef KA_HAVE_TRACELOGGING
+#include <winmeta.h>
+#include <TraceLoggingProvider.h>
+TRACELOGGING_DEFINE_PROVIDER(g_traceProvider, "KeepAudio",
+                             (0x43623eaa, 0xbeff, 0x43fa, 0x8a, 0xa8, 0x25, 0xea, 0x03, 0x3c, 0x23, 0x3f));
+#define KA_TRACE(name, level, keyword, ...) \
+    TraceLoggingWrite(g_traceProvider, name, TraceLoggingLevel(level), TraceLoggingKeyword(keyword), __VA_ARGS__)
+#define KA_TRACE_REGISTER() TraceLoggingRegister(g_traceProvider)
+#define KA_TRACE_UNREGISTER() TraceLoggingUnregister(g_traceProvider)
+#else
+#define KA_TRACE(name, level, keyword, ...) ((void)0)
+#define KA_TRACE_REGISTER() ((void)0)
+#define KA_TRACE_UNREGISTER() ((void)0)
+#endif
+#define KA_KW_BUFFER 0x1    // per-buffer events: submit, WHDR_DONE, late refill (high rate)
+#define KA_KW_DEVICE 0x2    // device open/close
+#define KA_KW_LIFECYCLE 0x4 // startup, shutdown reason
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
+#ifndef DRVM_MAPPER_PREFERRED_GET
+#define DRVM_MAPPER_PREFERRED_GET 0x2015 // mmddk.h: waveOut index WAVE_MAPPER currently plays to
+#endif
 
 typedef enum
 {
@@ -54,38 +182,325 @@ typedef enum
     FMT_FLOAT32 = 2
 } AudioFormat;
 
+// Sample layout a stream writes; winmm opens only S16/F32, WASAPI exclusive may adopt the others.
+typedef enum
+{
+    SAMPLE_S16 = 0,
+    SAMPLE_F32 = 1,
+    SAMPLE_S24 = 2, // packed 3-byte PCM
+    SAMPLE_S32 = 3  // 32-bit PCM container (also used for 24-in-32)
+} SampleType;
+
+typedef enum
+{
+    SYNTH_AUTO = 0, // LUT when the tone period fits, otherwise sine
+    SYNTH_LUT = 1,
+    SYNTH_SINE = 2,
+    SYNTH_PULSE = 3 // keep-alive pattern: zeros plus a short pulse every intervalMs
+} SynthMode;
+
+typedef enum
+{
+    KERNEL_AUTO = 0, // best the CPU supports
+    KERNEL_SCALAR = 1,
+    KERNEL_SSE2 = 2,
+    KERNEL_AVX2 = 3
+} FillKernelId;
+
+#define LUT_MAX_BYTES (4 * 1024 * 1024) // cap for the precomputed period table
+
+typedef enum
+{
+    POWER_ALWAYS = 0,       // keep the device awake regardless (streams still rebuilt across sleep)
+    POWER_AC = 1,           // only on AC power
+    POWER_DISPLAY = 2,      // only while the display is on
+    POWER_AC_OR_DISPLAY = 3 // on AC always; on battery only while the display is on
+} PowerPolicy;
+
+typedef enum
+{
+    BACKEND_WINMM = 0,
+    BACKEND_WASAPI = 1
+} AudioBackend;
+
+#define MAX_STREAMS 32 // well below MAXIMUM_WAIT_OBJECTS, leaving room for control handles
+#define ECO_MIN_BUFFERS 16 // --eco default queue depth
+#define ADAPT_MIN_BUFFERS 3
+#define ADAPT_MAX_BUFFERS 32       // same ceiling as --buffers; the arena reserves this many
+#define ADAPT_WINDOW_MS 2000       // slack is judged on the worst wake in each window
+#define ADAPT_LOW_SLACK_MS 50.0    // less audio than this still queued at a wake: grow
+#define ADAPT_HIGH_SLACK_MS 150.0  // one buffer fewer would still leave this much: may shrink
+#define ADAPT_CALM_WINDOWS 15      // ...after this many calm windows in a row (30 s)
+
 typedef struct
 {
     double freq;        // Hz
     double db;          // dBFS (negative)
     int rate;           // sample rate (Hz)
-    int deviceIndex;    // -1 = WAVE_MAPPER
+    BOOL rateMin;       // --rate min: negotiate the cheapest format per endpoint
+    int devices[MAX_STREAMS]; // device indexes to drive; -1 = WAVE_MAPPER / default endpoint
+    int numDevices;
+    BOOL allDevices;    // --device all
+    wchar_t deviceId[256];   // --device-id: endpoint ID, overrides --device
+    wchar_t deviceName[128]; // --device-name: friendly-name substring, overrides --device
+    BOOL json;          // --json: machine-readable --list-devices
+    BOOL standalone;    // --standalone: never hand over to (or serve) a running instance
+    char control[64];   // --control: command for the running instance ("" = none)
+    wchar_t profiles[MAX_PATH]; // --profiles: per-device profiles file ("" = PROFILES_DEFAULT, "none" = off)
     int channels;       // 1 or 2
     int bufferFrames;   // frames per buffer
     int numBuffers;     // number of buffers
     int chance;         // 0=disabled; else 1..100
     AudioFormat reqFmt; // requested format
+    SynthMode synth;    // requested synthesis path
+    FillKernelId kernel; // SIMD kernel for on-the-fly synthesis
+    int intervalMs;     // --interval: pulse spacing, 0 = calibrated value or PULSE_DEFAULT_INTERVAL_MS
+    BOOL calibrate;     // --calibrate: interactive interval search, then exit
+    BOOL staticBuffers; // tile the tone period across the headers and just resubmit them
+    BOOL lockMemory;    // VirtualLock the winmm buffer arena
+    BOOL adaptive;      // --adaptive: size the winmm queue from observed refill slack
+    BOOL mmcss;         // --mmcss: worker joins the MMCSS "Audio" task
+    BOOL eco;           // --eco: EcoQoS process, deeper buffering
+    AudioBackend backend;
+    BOOL exclusive;     // WASAPI exclusive mode in the device's native format
+    BOOL minPeriod;     // WASAPI at the minimum device/engine period
+    BOOL dutyCycle;     // pause while other sessions are audible on the endpoint
+    int graceMs;        // quiet time before resuming after other sessions stop
+    int benchSeconds;   // --bench: 0 = off, else how long to run the worker loop
+    double soakHours;   // --soak: 0 = off, else simulated playback hours per case
+    BOOL soakRebaseline; // --soak-rebaseline: overwrite the stored throughput baselines
+    wchar_t soakBaseline[MAX_PATH]; // --soak-baseline: INI file of baselines ("" = HKCU)
+    int statsSeconds;   // --stats: 0 = off, else log interval
+    BOOL lean;          // --lean: minimal resident footprint after setup
+    PowerPolicy powerPolicy;
     // Install/uninstall
     BOOL doInstall;
     BOOL doInstallCopy;
     BOOL doUninstall;
-    wchar_t startupName[128];
+    BOOL doInstallService;   // --install-service
+    BOOL doUninstallService; // --uninstall-service
+    BOOL service;            // --service: started by the SCM (set by --install-service)
+    wchar_t startupName[128]; // Run value name, or the service name with the *-service flags
     BOOL wantConsole;
 } Options;
 
 static volatile LONG g_running = 1; // global run flag
 static HANDLE g_audioThread = NULL;
-static HWAVEOUT g_hwo = NULL;
-static WAVEHDR *g_headers = NULL;
-static void **g_buffers = NULL;
-static int g_numBuffers = 0;
-static int g_bufBytes = 0;
-static BOOL g_usingFloat = FALSE;
-static int g_bufferFrames = 0;
-static int g_channels = 1;
-static double g_phase = 0.0, g_phaseStep = 0.0;
-static double g_db = -100.0;
-static int g_rate = 48000;
+static HANDLE g_shutdownEvent = NULL; // manual-reset; wakes the worker and the main loop on exit
+static double g_shutdownAtMs = 0;      // now_ms() of the first request_shutdown, for teardown timing
+#define WORKER_EXIT_WAIT_MS 2000 // the worker only has to leave its wait; bounds a driver call that hangs
+static HANDLE g_deviceChangeEvent = NULL; // auto-reset; set by the endpoint watcher
+static volatile LONG g_deviceEvents = 0;  // DEVEV_* bits accumulated since the worker last looked
+static LONGLONG g_startupUs = 0;         // process creation to every stream primed (set once by main)
+static volatile LONG g_wakeups = 0;       // worker returns from its wait (for --bench and stats)
+
+#define DEVEV_STATE 1   // an endpoint was added/removed/enabled/disabled
+#define DEVEV_DEFAULT 2 // the default console render endpoint changed
+#define DEVEV_POWER 4   // sleep/resume, display or AC state changed; re-evaluate --power-policy
+#define DEVEV_RESUME 8  // the system resumed from sleep
+#define DEVEV_JOIN 16   // another instance handed over its streams (g_joinRequest)
+#define DEVEV_CONTROL 32 // a control-pipe command is waiting (g_controlOp)
+#define DEVEV_PROFILES 64 // the profiles file was re-read (g_profileRequest)
+#define POWER_SUSPEND_WAIT_MS 1500 // how long PBT_APMSUSPEND waits for the worker to close devices
+#define LOST_RETRY_MS 5000 // fallback retry while a stream is lost, in case a notification was missed
+#define ACTIVITY_POLL_MS 1000 // --duty-cycle session poll interval
+#define ACTIVITY_PEAK 1e-5f   // session peak above this (-100 dBFS) counts as audible
+
+static volatile LONG g_systemSleeping = 0; // between PBT_APMSUSPEND and resume
+static volatile LONG g_onAc = 1;           // GUID_ACDC_POWER_SOURCE
+static volatile LONG g_displayOn = 1;      // GUID_CONSOLE_DISPLAY_STATE (dimmed counts as on)
+static BOOL g_streamsSuspended = FALSE;    // worker only: streams closed by the power policy
+static HANDLE g_powerAck = NULL;           // manual-reset; worker sets it after applying a power change
+static HPOWERNOTIFY g_displayNotify = NULL;
+static HPOWERNOTIFY g_acdcNotify = NULL;
+
+#define INSTANCE_MUTEX L"Local\\KeepAudio.Instance" // per logon session
+#define PIPE_MSG_CHARS 4096 // request/reply limit on the control pipe, in wchar_t
+#define PIPE_TIMEOUT_MS 2000
+#define REQUEST_WAIT_MS 5000 // how long the pipe waits for the worker to act on a request
+#define SERVICE_MUTEX L"Global\\KeepAudio.Service"  // held by the --service instance
+#define SERVICE_PIPE L"\\\\.\\pipe\\KeepAudio.Service"
+#define SERVICE_PIPE_SDDL L"D:(A;;GA;;;SY)(A;;GA;;;LS)(A;;GA;;;BA)(A;;GRGW;;;IU)" // interactive users may send requests
+#define SERVICE_MUTEX_SDDL L"D:(A;;GA;;;SY)(A;;GA;;;LS)(A;;GA;;;BA)(A;;0x00100000;;;IU)" // interactive users: SYNCHRONIZE
+#define SERVICE_RESTART_MS 5000 // SCM failure action delay
+static HANDLE g_instanceMutex = NULL;
+static BOOL g_asService = FALSE; // running under the SCM (--service)
+static SERVICE_STATUS_HANDLE g_serviceHandle = NULL;
+static void service_report(DWORD state, DWORD exitCode, DWORD waitHint);
+static HANDLE g_pipe = INVALID_HANDLE_VALUE; // control pipe server (main thread)
+static HANDLE g_pipeEvent = NULL;            // manual-reset; completes ConnectNamedPipe/ReadFile
+static OVERLAPPED g_pipeOv;
+static volatile LONG g_requestBusy = 0; // main posted a DEVEV_JOIN/CONTROL/PROFILES; worker clears when done
+static HANDLE g_requestAck = NULL;      // manual-reset; worker sets it once g_requestReply is ready
+
+// Control-pipe commands, applied by the worker between refills (DEVEV_CONTROL).
+typedef enum
+{
+    CTL_SET_LEVEL = 0,     // g_controlValue = dBFS
+    CTL_SET_FREQUENCY = 1, // g_controlValue = Hz
+    CTL_PAUSE = 2,
+    CTL_RESUME = 3,
+    CTL_DUMP_STATS = 4
+} ControlOp;
+static ControlOp g_controlOp;
+static double g_controlValue;
+static BOOL g_held = FALSE; // worker only: paused by the "pause" command until "resume"
+
+// One output endpoint driven by the shared worker.
+typedef struct
+{
+    int deviceIndex;     // -1 = default device (WAVE_MAPPER / default console endpoint)
+    AudioBackend backend;
+    const Options *opt;  // what the stream was opened with: g_config or a handed-over request
+    BOOL active;         // opened and part of the worker's wait set
+    BOOL lost;           // device went away; reopened on the next endpoint notification
+    BOOL paused;         // --duty-cycle: other audio is keeping the endpoint awake
+    double quietSinceMs; // --duty-cycle: when other sessions went silent (0 = not yet)
+    IAudioSessionManager2 *sessionMgr; // --duty-cycle: session list for this endpoint
+    double lostAtMs;     // now_ms() when the stream was lost
+    wchar_t endpointId[256]; // MMDevice endpoint ID, used to find the device again after hot-plug
+    LONGLONG framesQueued;   // frames handed to the device since open
+    LONGLONG refills;        // buffers (winmm) or GetBuffer rounds (WASAPI) written
+    LONGLONG lateRefills;    // the queue had run dry when the worker got to it
+    LONGLONG latencyTotalUs; // sum of wake-to-write times, for the average
+    LONGLONG latencyMaxUs;
+    LONG reconnects;         // successful reopen_stream calls
+    LONGLONG closeUs;        // last device teardown (reset, drain, close), for reopen and exit timing
+    wchar_t profile[128];    // profiles-file section governing the stream ("" = none)
+    const Options *baseOpt;  // with a profile: options to restore if its section goes (NULL = it added the stream)
+    HANDLE event;        // signalled by winmm (CALLBACK_EVENT) or IAudioClient when audio was consumed
+    SampleType sample;
+    double amp;          // peak in sample units (linear for float, LSB for PCM); fixed at open
+    int channels;
+    int rate;
+    double db;
+    double phase, phaseStep; // with a table: phase at the table's first frame
+    BOOL pulse;          // SYNTH_PULSE: buffers are zero apart from the keep-alive pulse
+    int pulseFrames;     // pulse length
+    int pulseInterval;   // frames from one pulse start to the next
+    int pulsePos;        // position of the next frame within the current interval
+    int bufferFrames;
+    // winmm
+    HWAVEOUT hwo;
+    WAVEHDR *headers;
+    void **buffers;
+    int numBuffers;      // headers in use (prepared or being retired)
+    int maxBuffers;      // arena capacity in headers; > numBuffers only with --adaptive
+    int targetBuffers;   // --adaptive: queue depth being converged to (headers >= it retire when done)
+    int minQueued;       // --adaptive: fewest headers still queued at a wake in this window
+    LONGLONG windowLate; // --adaptive: lateRefills when the window started
+    double windowStartMs;
+    int calmWindows;
+    SIZE_T bufStride;    // bufBytes rounded up to a cache line
+    int bufBytes;
+    BOOL staticBuffers; // headers hold the whole period; completed ones are resubmitted as-is
+    void *arena;        // one VirtualAlloc block: headers + buffer pointers, then the sample buffers
+    SIZE_T arenaBytes;
+    SIZE_T arenaDataOffset; // page-aligned start of the sample buffers (read-only once primed in static mode)
+    // tone table: one exact period, interleaved, in the opened sample format
+    void *lut;
+    int lutFrames;
+    int lutPos; // next frame to copy out of lut
+    long long lutCycles; // tone cycles per table; frame k holds phase + 2*pi*(k*lutCycles % lutFrames)/lutFrames
+    int staticNext;      // static buffers: next header to come back (they play in ring order)
+    // WASAPI
+    IMMDevice *mmDevice;
+    IAudioClient *audioClient;
+    IAudioRenderClient *renderClient;
+    UINT32 wasapiFrames;   // endpoint buffer size in frames
+    BOOL wasapiExclusive;  // exclusive event mode: each event refills one whole buffer
+} AudioStream;
+
+static AudioStream g_streams[MAX_STREAMS];
+
+// Shared-memory stats block (Local\KeepAudio.Stats.<pid>). Readers retry while seq is odd
+// or changes across the read. Bump KA_STATS_VERSION when the layout changes.
+#define KA_STATS_MAGIC 0x5341414B // "KAAS"
+#define KA_STATS_VERSION 4
+#define STATS_PUBLISH_MS 1000
+typedef struct
+{
+    LONG deviceIndex;
+    LONG active;
+    LONG paused;
+    LONG lost;
+    LONG reconnects;
+    LONG channels;
+    LONGLONG framesWritten;
+    LONGLONG refills;
+    LONGLONG lateRefills;
+    LONGLONG latencyTotalUs;
+    LONGLONG latencyMaxUs;
+    LONGLONG closeUs;
+} KeepAudioStreamStats;
+typedef struct
+{
+    DWORD magic;
+    DWORD version;
+    DWORD size;
+    DWORD pid;
+    volatile LONG seq;
+    LONG numStreams;
+    LONGLONG wakeups;
+    ULONGLONG updatedTick; // GetTickCount64 at the last publish
+    ULONGLONG workingSetBytes;
+    ULONGLONG privateBytes; // commit charge (PrivateUsage)
+    LONGLONG startupUs;     // process creation to every stream primed
+    KeepAudioStreamStats streams[MAX_STREAMS];
+} KeepAudioStats;
+static HANDLE g_statsMapping = NULL;
+static KeepAudioStats *g_stats = NULL;
+static int g_numStreams = 0;
+static BOOL g_comInit = FALSE;
+static Options g_config; // options the streams were opened with; reused when reopening after hot-plug
+static Options g_joinRequest;            // main -> worker: a second instance's options
+static wchar_t g_requestReply[PIPE_MSG_CHARS]; // worker -> main: answer for the pipe client
+static Options g_joined[MAX_STREAMS];    // options of handed-over streams (AudioStream.opt points here)
+static int g_numJoined = 0;
+
+// Per-device profiles (--profiles, default %ProgramData%\KeepAudio\profiles.ini): one INI section
+// per endpoint, named by its ID or a friendly-name fragment, whose keys are per-stream flags
+// without the dashes. Each section is layered over this instance's own command line.
+#define PROFILES_DEFAULT L"%ProgramData%\\KeepAudio\\profiles.ini"
+#define PROFILE_SETTLE_MS 250 // editors and copy tools write in steps; reload once they stop
+// Default directory as --install-service leaves it: administrators write, everyone reads.
+#define PROFILES_DIR_SDDL L"O:BAD:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)(A;OICI;FR;;;AU)(A;OICI;FR;;;LS)"
+typedef struct
+{
+    wchar_t name[128]; // section name
+    Options opt;       // command line + section keys, bound to the section's endpoint
+} Profile;
+static Profile g_profiles[MAX_STREAMS];       // worker: the sections in effect
+static int g_numProfiles = 0;
+static Profile g_profileRequest[MAX_STREAMS]; // main -> worker: a re-read file (DEVEV_PROFILES)
+static int g_numProfileRequest = 0;
+static Options g_profileOpts[MAX_STREAMS];    // per g_streams slot: options of a profiled stream
+static wchar_t g_profilePath[MAX_PATH];
+static wchar_t g_baseArgs[PIPE_MSG_CHARS];    // the command line sections are layered over
+static HANDLE g_profileDir = INVALID_HANDLE_VALUE; // directory watch (ReadDirectoryChangesW)
+static BOOL g_profileWatchParent = FALSE;         // the directory does not exist yet; watching its parent
+static HANDLE g_profileEvent = NULL;
+static OVERLAPPED g_profileOv;
+static DWORD g_profileNotify[1024]; // FILE_NOTIFY_INFORMATION records (DWORD-aligned)
+static IMMDeviceEnumerator *g_devEnumerator = NULL; // holds the endpoint watcher registration
+
+// MMDevice/WASAPI IDs, defined locally so the build does not depend on uuid.lib carrying them.
+static const GUID KA_CLSID_MMDeviceEnumerator = {0xBCDE0395, 0xE52F, 0x467C, {0x8E, 0x3D, 0xC4, 0x57, 0x92, 0x91, 0x69, 0x2E}};
+static const GUID KA_IID_IMMDeviceEnumerator = {0xA95664D2, 0x9614, 0x4F35, {0xA7, 0x46, 0xDE, 0x8D, 0xB6, 0x36, 0x17, 0xE6}};
+static const GUID KA_IID_IAudioClient = {0x1CB9AD4C, 0xDBFA, 0x4C32, {0xB1, 0x78, 0xC2, 0xF5, 0x68, 0xA7, 0x03, 0xB2}};
+static const GUID KA_IID_IAudioRenderClient = {0xF294ACFC, 0x3146, 0x4483, {0xA7, 0xBF, 0xAD, 0xDC, 0xA7, 0xC2, 0x60, 0xE2}};
+static const GUID KA_KSDATAFORMAT_SUBTYPE_PCM = {0x00000001, 0x0000, 0x0010, {0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71}};
+static const GUID KA_KSDATAFORMAT_SUBTYPE_IEEE_FLOAT = {0x00000003, 0x0000, 0x0010, {0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71}};
+static const GUID KA_IID_IUnknown = {0x00000000, 0x0000, 0x0000, {0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46}};
+static const GUID KA_IID_IMMNotificationClient = {0x7991EEC9, 0x7E89, 0x4D85, {0x83, 0x90, 0x6C, 0x70, 0x3C, 0xEC, 0x60, 0xC0}};
+static const GUID KA_IID_IAudioSessionManager2 = {0x77AA99A0, 0x1BD6, 0x484F, {0x8B, 0xC7, 0x2C, 0x65, 0x4C, 0x9A, 0x9B, 0x6F}};
+static const GUID KA_IID_IAudioSessionControl2 = {0xBFB7FF88, 0x7239, 0x4FC9, {0x8F, 0xA2, 0x07, 0xC9, 0x50, 0xBE, 0x9C, 0x6D}};
+static const GUID KA_IID_IAudioMeterInformation = {0xC02216F6, 0x8C67, 0x4B5B, {0x9D, 0x00, 0xD0, 0x08, 0xE7, 0x3E, 0x00, 0x64}};
+static const GUID KA_GUID_CONSOLE_DISPLAY_STATE = {0x6FE69556, 0x704A, 0x47A0, {0x8F, 0x24, 0xC2, 0x8D, 0x93, 0x6F, 0xDA, 0x47}};
+static const GUID KA_GUID_ACDC_POWER_SOURCE = {0x5D3E9A59, 0xE9D5, 0x4B00, {0xA6, 0xBD, 0xFF, 0x34, 0xFF, 0x51, 0x65, 0x48}};
+static const GUID KA_IID_IAudioClient3 = {0x7ED4EE07, 0x8E67, 0x4CD4, {0x8C, 0x1A, 0x2B, 0x7A, 0x59, 0x87, 0xAD, 0x42}};
+static const PROPERTYKEY KA_PKEY_AudioEngine_DeviceFormat = {{0xF19F064D, 0x082C, 0x4E27, {0xBC, 0x73, 0x68, 0x82, 0xA1, 0xBB, 0x8E, 0x4C}}, 0};
+static const PROPERTYKEY KA_PKEY_Device_FriendlyName = {{0xA45C254E, 0xDF1C, 0x4EFD, {0x80, 0x20, 0x67, 0xD1, 0x46, 0xA8, 0x50, 0xE0}}, 14};
 
 static void dlog(const char *fmt, ...)
 {
@@ -114,6 +529,15 @@ static double clamp_double(double v, double lo, double hi)
         return hi;
     return v;
 }
+static double now_ms(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1000.0 / (double)freq.QuadPart;
+}
 static int clamp_int(int v, int lo, int hi)
 {
     if (v < lo)
@@ -153,6 +577,185 @@ static int str_eq_ci(const char *a, const char *b)
     return _stricmp(a, b) == 0;
 }
 
+// MMDevice helpers (WASAPI backend and device listing). Caller owns COM init.
+static IMMDeviceEnumerator *mm_create_enumerator(void)
+{
+    IMMDeviceEnumerator *en = NULL;
+    if (FAILED(CoCreateInstance(&KA_CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL, &KA_IID_IMMDeviceEnumerator, (void **)&en)))
+        return NULL;
+    return en;
+}
+// index < 0 = default console render endpoint; otherwise the Nth active render endpoint.
+static IMMDevice *mm_get_render_device(int index)
+{
+    IMMDeviceEnumerator *en = mm_create_enumerator();
+    IMMDevice *dev = NULL;
+    if (!en)
+        return NULL;
+    if (index < 0)
+    {
+        IMMDeviceEnumerator_GetDefaultAudioEndpoint(en, eRender, eConsole, &dev);
+    }
+    else
+    {
+        IMMDeviceCollection *col = NULL;
+        if (SUCCEEDED(IMMDeviceEnumerator_EnumAudioEndpoints(en, eRender, DEVICE_STATE_ACTIVE, &col)))
+        {
+            IMMDeviceCollection_Item(col, (UINT)index, &dev);
+            IMMDeviceCollection_Release(col);
+        }
+    }
+    IMMDeviceEnumerator_Release(en);
+    return dev;
+}
+static void mm_device_friendly_name(IMMDevice *dev, wchar_t *buf, size_t cap)
+{
+    IPropertyStore *props = NULL;
+    buf[0] = L'\0';
+    if (FAILED(IMMDevice_OpenPropertyStore(dev, STGM_READ, &props)))
+        return;
+    PROPVARIANT pv;
+    PropVariantInit(&pv);
+    if (SUCCEEDED(IPropertyStore_GetValue(props, &KA_PKEY_Device_FriendlyName, &pv)) && pv.vt == VT_LPWSTR)
+    {
+        wcsncpy(buf, pv.pwszVal, cap);
+        buf[cap - 1] = L'\0';
+    }
+    PropVariantClear(&pv);
+    IPropertyStore_Release(props);
+}
+
+static IMMDevice *mm_get_device_by_id(const wchar_t *id)
+{
+    IMMDeviceEnumerator *en = mm_create_enumerator();
+    IMMDevice *dev = NULL;
+    if (!en)
+        return NULL;
+    IMMDeviceEnumerator_GetDevice(en, id, &dev);
+    IMMDeviceEnumerator_Release(en);
+    return dev;
+}
+static BOOL mm_endpoint_active(const wchar_t *id)
+{
+    IMMDevice *dev = mm_get_device_by_id(id);
+    DWORD state = 0;
+    if (!dev)
+        return FALSE;
+    IMMDevice_GetState(dev, &state);
+    IMMDevice_Release(dev);
+    return state == DEVICE_STATE_ACTIVE;
+}
+// Endpoint ID behind a waveOut index (same string IMMDevice::GetId returns).
+static BOOL winmm_endpoint_id(UINT index, wchar_t *buf, size_t cap)
+{
+    ULONG bytes = 0;
+    buf[0] = L'\0';
+    if (waveOutMessage((HWAVEOUT)(UINT_PTR)index, DRV_QUERYFUNCTIONINSTANCEIDSIZE, (DWORD_PTR)&bytes, 0) != MMSYSERR_NOERROR ||
+        bytes == 0 || bytes > cap * sizeof(wchar_t))
+        return FALSE;
+    return waveOutMessage((HWAVEOUT)(UINT_PTR)index, DRV_QUERYFUNCTIONINSTANCEID, (DWORD_PTR)buf, bytes) == MMSYSERR_NOERROR;
+}
+// Endpoint the waveOut mapper (WAVE_MAPPER) currently plays to.
+static BOOL winmm_default_endpoint_id(wchar_t *buf, size_t cap)
+{
+    DWORD index = 0, flags = 0;
+    buf[0] = L'\0';
+    if (waveOutMessage((HWAVEOUT)(UINT_PTR)WAVE_MAPPER, DRVM_MAPPER_PREFERRED_GET, (DWORD_PTR)&index, (DWORD_PTR)&flags) !=
+        MMSYSERR_NOERROR)
+        return FALSE;
+    return winmm_endpoint_id(index, buf, cap);
+}
+// waveOut indexes shift when USB devices come and go; look the endpoint up again. -1 = not present.
+static int winmm_index_for_endpoint(const wchar_t *id)
+{
+    UINT count = waveOutGetNumDevs();
+    wchar_t other[256];
+    for (UINT i = 0; i < count; ++i)
+    {
+        if (winmm_endpoint_id(i, other, _countof(other)) && _wcsicmp(other, id) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+// Same for the WASAPI backend's index into the active endpoint list.
+static int mm_index_for_endpoint(const wchar_t *id)
+{
+    for (int i = 0;; ++i)
+    {
+        IMMDevice *dev = mm_get_render_device(i);
+        LPWSTR other = NULL;
+        if (!dev)
+            return -1;
+        BOOL match = SUCCEEDED(IMMDevice_GetId(dev, &other)) && _wcsicmp(other, id) == 0;
+        if (other)
+            CoTaskMemFree(other);
+        IMMDevice_Release(dev);
+        if (match)
+            return i;
+    }
+}
+
+// --device-name: first active render endpoint whose friendly name contains text (any case).
+static BOOL mm_find_endpoint_by_name(const wchar_t *text, wchar_t *id, size_t cap)
+{
+    wchar_t needle[128];
+    wcsncpy(needle, text, _countof(needle));
+    needle[_countof(needle) - 1] = L'\0';
+    _wcslwr(needle);
+    for (int i = 0;; ++i)
+    {
+        IMMDevice *dev = mm_get_render_device(i);
+        wchar_t name[256];
+        LPWSTR devId = NULL;
+        if (!dev)
+            return FALSE;
+        mm_device_friendly_name(dev, name, _countof(name));
+        _wcslwr(name);
+        BOOL match = wcsstr(name, needle) && SUCCEEDED(IMMDevice_GetId(dev, &devId));
+        if (match)
+        {
+            wcsncpy(id, devId, cap);
+            id[cap - 1] = L'\0';
+            CoTaskMemFree(devId);
+        }
+        IMMDevice_Release(dev);
+        if (match)
+            return TRUE;
+    }
+}
+
+static int winmm_min_rate(UINT deviceId, SampleType type, int channels);
+static int wasapi_min_shared_rate(IMMDevice *dev, int *channels);
+static int wasapi_min_exclusive_rate(IMMDevice *dev, int *channels);
+
+// What --rate min would open on a device, for the listing.
+static void winmm_min_summary(UINT index, wchar_t *buf, size_t cap)
+{
+    int rate = winmm_min_rate(index, SAMPLE_S16, 1);
+    if (rate)
+        _snwprintf(buf, cap, L"--rate min: %d Hz mono pcm16", rate);
+    else
+        _snwprintf(buf, cap, L"--rate min: no mono pcm16 rate");
+    buf[cap - 1] = L'\0';
+}
+static void wasapi_min_summary(IMMDevice *dev, wchar_t *buf, size_t cap)
+{
+    int channels = 0, sharedChannels = 0;
+    int shared = wasapi_min_shared_rate(dev, &sharedChannels);
+    int exclusive = wasapi_min_exclusive_rate(dev, &channels);
+    wchar_t ex[64];
+    if (exclusive)
+        _snwprintf(ex, _countof(ex), L"exclusive %d Hz %d ch pcm16", exclusive, channels);
+    else
+        _snwprintf(ex, _countof(ex), L"exclusive: no pcm16 rate");
+    ex[_countof(ex) - 1] = L'\0';
+    if (shared)
+        _snwprintf(buf, cap, L"--rate min: shared %d Hz %d ch pcm16, %ls", shared, sharedChannels, ex);
+    else
+        _snwprintf(buf, cap, L"--rate min: shared unavailable, %ls", ex);
+    buf[cap - 1] = L'\0';
+}
+
 static void list_devices_ui(BOOL console)
 {
     UINT count = waveOutGetNumDevs();
@@ -166,15 +769,64 @@ static void list_devices_ui(BOOL console)
             {
                 char line[512];
                 char name[512];
+                wchar_t wmin[96];
+                char umin[192];
                 WideCharToMultiByte(CP_UTF8, 0, caps.szPname, -1, name, sizeof(name), NULL, NULL);
-                _snprintf(line, sizeof(line), "  [%u] %s\n", i, name);
+                winmm_min_summary(i, wmin, _countof(wmin));
+                WideCharToMultiByte(CP_UTF8, 0, wmin, -1, umin, sizeof(umin), NULL, NULL);
+                _snprintf(line, sizeof(line), "  [%u] %s  (%s)\n", i, name, umin);
                 dlog("%s", line);
             }
         }
         if (count == 0)
             dlog("  (No waveOut devices found)\n");
     }
-    else
+    // WASAPI endpoints, in the order --backend wasapi --device N uses.
+    wchar_t endpoints[4096];
+    endpoints[0] = L'\0';
+    if (console)
+        dlog("WASAPI endpoints (--backend wasapi):\n");
+    BOOL comOk = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    int endpointCount = 0;
+    for (;; ++endpointCount)
+    {
+        IMMDevice *dev = mm_get_render_device(endpointCount);
+        if (!dev)
+            break;
+        wchar_t name[256], line[448], wmin[160], id[256];
+        LPWSTR devId = NULL;
+        id[0] = L'\0';
+        if (SUCCEEDED(IMMDevice_GetId(dev, &devId)))
+        {
+            wcsncpy(id, devId, _countof(id));
+            id[_countof(id) - 1] = L'\0';
+            CoTaskMemFree(devId);
+        }
+        mm_device_friendly_name(dev, name, _countof(name));
+        wasapi_min_summary(dev, wmin, _countof(wmin));
+        IMMDevice_Release(dev);
+        if (console)
+        {
+            char uname[512], umin[320];
+            WideCharToMultiByte(CP_UTF8, 0, name, -1, uname, sizeof(uname), NULL, NULL);
+            WideCharToMultiByte(CP_UTF8, 0, wmin, -1, umin, sizeof(umin), NULL, NULL);
+            dlog("  [%d] %s  (%s)\n", endpointCount, uname, umin);
+            char uid[512];
+            WideCharToMultiByte(CP_UTF8, 0, id, -1, uid, sizeof(uid), NULL, NULL);
+            dlog("      id: %s\n", uid);
+        }
+        else
+        {
+            _snwprintf(line, _countof(line), L"  [%d] %ls  (%ls)\n", endpointCount, name, wmin);
+            if (wcslen(endpoints) + wcslen(line) + 1 < _countof(endpoints))
+                wcscat(endpoints, line);
+        }
+    }
+    if (comOk)
+        CoUninitialize();
+    if (console && endpointCount == 0)
+        dlog("  (none)\n");
+    if (!console)
     {
         wchar_t msg[4096];
         msg[0] = L'\0';
@@ -183,17 +835,188 @@ static void list_devices_ui(BOOL console)
         {
             if (waveOutGetDevCapsW(i, &caps, sizeof(caps)) == MMSYSERR_NOERROR)
             {
-                wchar_t line[512];
-                _snwprintf(line, _countof(line), L"  [%u] %ls\n", i, caps.szPname);
-                wcscat(msg, line);
+                wchar_t line[512], wmin[96];
+                winmm_min_summary(i, wmin, _countof(wmin));
+                _snwprintf(line, _countof(line), L"  [%u] %ls  (%ls)\n", i, caps.szPname, wmin);
+                if (wcslen(msg) + wcslen(line) + 1 < _countof(msg))
+                    wcscat(msg, line);
             }
         }
         if (count == 0)
             wcscat(msg, L"  (No waveOut devices found)\n");
+        wcscat(msg, L"\nWASAPI endpoints (--backend wasapi):\n");
+        if (wcslen(msg) + wcslen(endpoints) + 1 < _countof(msg))
+            wcscat(msg, endpoints[0] ? endpoints : L"  (none)\n");
         MessageBoxW(NULL, msg, L"KeepAudio - Devices", MB_OK | MB_ICONINFORMATION);
     }
 }
 
+// Growable UTF-8 buffer for --json.
+typedef struct
+{
+    char *p;
+    size_t len, cap;
+} JsonBuf;
+
+static void json_raw(JsonBuf *j, const char *fmt, ...)
+{
+    char tmp[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = _vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(tmp))
+        n = (int)sizeof(tmp) - 1;
+    if (j->len + n + 1 > j->cap)
+    {
+        size_t cap = max(j->cap * 2, j->len + n + 1024);
+        char *p = j->p ? (char *)HeapReAlloc(GetProcessHeap(), 0, j->p, cap) : (char *)HeapAlloc(GetProcessHeap(), 0, cap);
+        if (!p)
+            return;
+        j->p = p;
+        j->cap = cap;
+    }
+    memcpy(j->p + j->len, tmp, n);
+    j->len += n;
+    j->p[j->len] = '\0';
+}
+static void json_str(JsonBuf *j, const wchar_t *w)
+{
+    char u[1024];
+    WideCharToMultiByte(CP_UTF8, 0, w ? w : L"", -1, u, sizeof(u), NULL, NULL);
+    u[sizeof(u) - 1] = '\0';
+    json_raw(j, "\"");
+    for (const unsigned char *c = (const unsigned char *)u; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+            json_raw(j, "\\%c", *c);
+        else if (*c < 0x20)
+            json_raw(j, "\\u%04x", *c);
+        else
+            json_raw(j, "%c", *c);
+    }
+    json_raw(j, "\"");
+}
+
+static BOOL wasapi_format_usable(const WAVEFORMATEX *wfx, SampleType *type);
+static const char *sample_name(SampleType t);
+
+// One WASAPI endpoint: ID, name, default flag, mix format, device/engine periods, --rate min.
+static void json_endpoint(JsonBuf *j, int index, IMMDevice *dev, const wchar_t *defaultId)
+{
+    wchar_t name[256];
+    LPWSTR id = NULL;
+    IMMDevice_GetId(dev, &id);
+    mm_device_friendly_name(dev, name, _countof(name));
+    json_raw(j, "    {\"index\": %d, \"id\": ", index);
+    json_str(j, id);
+    json_raw(j, ", \"name\": ");
+    json_str(j, name);
+    json_raw(j, ", \"default\": %s", (id && defaultId[0] && _wcsicmp(id, defaultId) == 0) ? "true" : "false");
+    if (id)
+        CoTaskMemFree(id);
+
+    IAudioClient *probe = NULL;
+    WAVEFORMATEX *mix = NULL;
+    if (SUCCEEDED(IMMDevice_Activate(dev, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)) &&
+        SUCCEEDED(IAudioClient_GetMixFormat(probe, &mix)))
+    {
+        SampleType type;
+        json_raw(j, ",\n     \"mixFormat\": {\"rate\": %lu, \"channels\": %u, \"bits\": %u, \"sample\": \"%s\"}",
+                 (unsigned long)mix->nSamplesPerSec, (unsigned)mix->nChannels, (unsigned)mix->wBitsPerSample,
+                 wasapi_format_usable(mix, &type) ? sample_name(type) : "other");
+        REFERENCE_TIME defPeriod = 0, minPeriod = 0;
+        if (SUCCEEDED(IAudioClient_GetDevicePeriod(probe, &defPeriod, &minPeriod)))
+            json_raw(j, ",\n     \"devicePeriodMs\": {\"default\": %.3f, \"min\": %.3f}", defPeriod / 10000.0, minPeriod / 10000.0);
+#ifdef __IAudioClient3_INTERFACE_DEFINED__
+        IAudioClient3 *ac3 = NULL;
+        if (SUCCEEDED(IMMDevice_Activate(dev, &KA_IID_IAudioClient3, CLSCTX_ALL, NULL, (void **)&ac3)))
+        {
+            UINT32 defFrames = 0, fundFrames = 0, minFrames = 0, maxFrames = 0;
+            if (SUCCEEDED(IAudioClient3_GetSharedModeEnginePeriod(ac3, mix, &defFrames, &fundFrames, &minFrames, &maxFrames)))
+                json_raw(j, ",\n     \"enginePeriodFrames\": {\"default\": %u, \"fundamental\": %u, \"min\": %u, \"max\": %u}",
+                         defFrames, fundFrames, minFrames, maxFrames);
+            IAudioClient3_Release(ac3);
+        }
+#endif
+        CoTaskMemFree(mix);
+    }
+    if (probe)
+        IAudioClient_Release(probe);
+    int channels = 0, sharedChannels = 0;
+    int shared = wasapi_min_shared_rate(dev, &sharedChannels);
+    int exclusive = wasapi_min_exclusive_rate(dev, &channels);
+    json_raw(j, ",\n     \"rateMin\": {\"shared\": %d, \"sharedChannels\": %d, \"exclusive\": %d, \"exclusiveChannels\": %d}}",
+             shared, shared ? sharedChannels : 0, exclusive, exclusive ? channels : 0);
+}
+
+// --list-devices --json: to stdout when there is one (redirected or --console), else a MessageBox.
+static void list_devices_json(void)
+{
+    JsonBuf j = {NULL, 0, 0};
+    WAVEOUTCAPSW caps;
+    UINT count = waveOutGetNumDevs();
+    BOOL first = TRUE;
+    json_raw(&j, "{\n  \"waveOut\": [");
+    for (UINT i = 0; i < count; ++i)
+    {
+        wchar_t id[256];
+        if (waveOutGetDevCapsW(i, &caps, sizeof(caps)) != MMSYSERR_NOERROR)
+            continue;
+        winmm_endpoint_id(i, id, _countof(id));
+        json_raw(&j, "%s\n    {\"index\": %u, \"name\": ", first ? "" : ",", i);
+        first = FALSE;
+        json_str(&j, caps.szPname);
+        json_raw(&j, ", \"endpointId\": ");
+        json_str(&j, id);
+        json_raw(&j, ", \"channels\": %u, \"rateMin\": %d}", (unsigned)caps.wChannels, winmm_min_rate(i, SAMPLE_S16, 1));
+    }
+    json_raw(&j, "\n  ],\n  \"endpoints\": [");
+    BOOL comOk = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    wchar_t defaultId[256];
+    defaultId[0] = L'\0';
+    IMMDevice *def = mm_get_render_device(-1);
+    if (def)
+    {
+        LPWSTR id = NULL;
+        if (SUCCEEDED(IMMDevice_GetId(def, &id)))
+        {
+            wcsncpy(defaultId, id, _countof(defaultId));
+            defaultId[_countof(defaultId) - 1] = L'\0';
+            CoTaskMemFree(id);
+        }
+        IMMDevice_Release(def);
+    }
+    for (int i = 0;; ++i)
+    {
+        IMMDevice *dev = mm_get_render_device(i);
+        if (!dev)
+            break;
+        json_raw(&j, "%s\n", i ? "," : "");
+        json_endpoint(&j, i, dev, defaultId);
+        IMMDevice_Release(dev);
+    }
+    if (comOk)
+        CoUninitialize();
+    json_raw(&j, "\n  ]\n}\n");
+    if (!j.p)
+        return;
+    HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD written = 0;
+    if (!out || out == INVALID_HANDLE_VALUE || !WriteFile(out, j.p, (DWORD)j.len, &written, NULL))
+    {
+        int wlen = MultiByteToWideChar(CP_UTF8, 0, j.p, -1, NULL, 0);
+        wchar_t *w = (wchar_t *)HeapAlloc(GetProcessHeap(), 0, wlen * sizeof(wchar_t));
+        if (w)
+        {
+            MultiByteToWideChar(CP_UTF8, 0, j.p, -1, w, wlen);
+            MessageBoxW(NULL, w, L"KeepAudio - Devices (JSON)", MB_OK | MB_ICONINFORMATION);
+            HeapFree(GetProcessHeap(), 0, w);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, j.p);
+}
+
 static BOOL get_exe_path_w(wchar_t *buf, DWORD cap)
 {
     DWORD n = GetModuleFileNameW(NULL, buf, cap);
@@ -260,16 +1083,30 @@ static BOOL build_persisted_args_w(int argc, char **argv, wchar_t *out, size_t o
         if (strcmp(a, "--install") == 0 || strcmp(a, "--install-copy") == 0 ||
             strcmp(a, "--uninstall") == 0 || strcmp(a, "--list-devices") == 0 ||
             strcmp(a, "--startup-name") == 0 || strcmp(a, "--console") == 0 ||
-            strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0 || strcmp(a, "/?") == 0)
+            strcmp(a, "--bench") == 0 || strcmp(a, "--calibrate") == 0 || strcmp(a, "--json") == 0 ||
+            strcmp(a, "--control") == 0 || strcmp(a, "--install-service") == 0 ||
+            strcmp(a, "--uninstall-service") == 0 || strcmp(a, "--service") == 0 || strcmp(a, "--soak") == 0 ||
+            strcmp(a, "--soak-rebaseline") == 0 || strcmp(a, "--soak-baseline") == 0 || strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0 || strcmp(a, "/?") == 0)
         {
-            if (strcmp(a, "--startup-name") == 0 && i + 1 < argc && argv[i + 1] && argv[i + 1][0] != '-')
+            if ((strcmp(a, "--startup-name") == 0 || strcmp(a, "--bench") == 0 || strcmp(a, "--soak") == 0 ||
+                 strcmp(a, "--soak-baseline") == 0) &&
+                i + 1 < argc && argv[i + 1] &&
+                argv[i + 1][0] != '-')
+                ++i;
+            for (int k = 0; strcmp(a, "--control") == 0 && k < 2 && i + 1 < argc && argv[i + 1] &&
+                            strncmp(argv[i + 1], "--", 2) != 0;
+                 ++k)
                 ++i;
             continue;
         }
         // include known flags (+ value)
         if (strcmp(a, "--freq") == 0 || strcmp(a, "--db") == 0 || strcmp(a, "--rate") == 0 ||
             strcmp(a, "--device") == 0 || strcmp(a, "--channels") == 0 || strcmp(a, "--frames") == 0 ||
-            strcmp(a, "--buffers") == 0 || strcmp(a, "--chance") == 0 || strcmp(a, "--format") == 0)
+            strcmp(a, "--buffers") == 0 || strcmp(a, "--chance") == 0 || strcmp(a, "--format") == 0 ||
+            strcmp(a, "--synth") == 0 || strcmp(a, "--kernel") == 0 || strcmp(a, "--backend") == 0 || strcmp(a, "--grace") == 0 ||
+            strcmp(a, "--stats") == 0 || strcmp(a, "--power-policy") == 0 ||
+            strcmp(a, "--interval") == 0 || strcmp(a, "--device-id") == 0 || strcmp(a, "--device-name") == 0 ||
+            strcmp(a, "--profiles") == 0)
         {
             int w1 = MultiByteToWideChar(CP_UTF8, 0, a, -1, NULL, 0);
             wchar_t wflag[256] = {0};
@@ -343,6 +1180,64 @@ static BOOL reg_delete_run_value_w(const wchar_t *name)
     return (r == ERROR_SUCCESS);
 }
 
+// Negotiated-format cache: HKCU\Software\KeepAudio\FormatCache, one REG_BINARY value per
+// backend + endpoint ID. An entry is used only while both fingerprints match: the options that
+// shaped the negotiation, and the device's advertised capabilities (driver caps for winmm, the
+// engine device format for WASAPI). A stale or failing entry is dropped and renegotiated.
+#define FMT_CACHE_KEY L"Software\\KeepAudio\\FormatCache"
+#define FMT_CACHE_VERSION 1
+typedef struct
+{
+    DWORD version;
+    DWORD request; // fmt_request_hash of the options
+    DWORD caps;    // device capability fingerprint
+    DWORD sample;  // SampleType
+    DWORD rate;
+    DWORD channels;
+    DWORD native;  // WASAPI exclusive: the device's own format blob was used
+    LONGLONG period; // WASAPI exclusive: aligned periodicity (100 ns)
+} FormatCacheEntry;
+
+static DWORD fnv1a(DWORD h, const void *p, size_t n)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ b[i]) * 16777619u;
+    return h;
+}
+static DWORD fmt_request_hash(const Options *opt)
+{
+    int key[8] = {opt->backend, opt->exclusive, opt->minPeriod, opt->reqFmt, opt->rate, opt->channels, opt->db <= -96.0, opt->rateMin};
+    return fnv1a(2166136261u, key, sizeof(key));
+}
+static BOOL fmt_cache_load(const wchar_t *name, DWORD request, DWORD caps, FormatCacheEntry *out)
+{
+    DWORD type = 0, bytes = sizeof(*out);
+    HKEY hKey = NULL;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, FMT_CACHE_KEY, 0, KEY_QUERY_VALUE, &hKey) != ERROR_SUCCESS)
+        return FALSE;
+    LONG r = RegQueryValueExW(hKey, name, NULL, &type, (BYTE *)out, &bytes);
+    RegCloseKey(hKey);
+    return r == ERROR_SUCCESS && type == REG_BINARY && bytes == sizeof(*out) && out->version == FMT_CACHE_VERSION &&
+           out->request == request && out->caps == caps;
+}
+static void fmt_cache_store(const wchar_t *name, const FormatCacheEntry *e)
+{
+    HKEY hKey = NULL;
+    if (RegCreateKeyExW(HKEY_CURRENT_USER, FMT_CACHE_KEY, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL) != ERROR_SUCCESS)
+        return;
+    RegSetValueExW(hKey, name, 0, REG_BINARY, (const BYTE *)e, sizeof(*e));
+    RegCloseKey(hKey);
+}
+static void fmt_cache_drop(const wchar_t *name)
+{
+    HKEY hKey = NULL;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, FMT_CACHE_KEY, 0, KEY_SET_VALUE, &hKey) != ERROR_SUCCESS)
+        return;
+    RegDeleteValueW(hKey, name);
+    RegCloseKey(hKey);
+}
+
 // RNG
 static uint32_t g_rng_state = 1u;
 static uint32_t rng_u32(void)
@@ -383,490 +1278,5103 @@ static int rng_roll_1_to_100(void)
     return (int)(r % range) + 1;
 }
 
-// Audio filling
+// Audio filling. One scalar sine writer is stamped out per sample type and channel count:
+// with CH fixed the channel loop has a constant trip count and unrolls, and the phase
+// wraps once per call instead of per frame. CH 0 = any channel count (runtime).
+#define KA_STORE_S16(p, s) (*(int16_t *)(p) = (int16_t)(s))
+#define KA_STORE_F32(p, s) (*(float *)(p) = (float)(s))
+#define KA_STORE_S32(p, s) (*(int32_t *)(p) = (int32_t)(s))
+#define KA_STORE_S24(p, s)              \
+    do                                  \
+    {                                   \
+        int32_t v_ = (int32_t)(s);      \
+        (p)[0] = (uint8_t)v_;           \
+        (p)[1] = (uint8_t)(v_ >> 8);    \
+        (p)[2] = (uint8_t)(v_ >> 16);   \
+    } while (0)
+
+#define KA_DEFINE_SINE_WRITER(NAME, BYTES, STORE, CH)                                                  \
+    static void NAME(void *out, int frames, int channels, double *phase, double step, double amp)    \
+    {                                                                                                 \
+        uint8_t *p = (uint8_t *)out;                                                                  \
+        const int ch = (CH) ? (CH) : channels;                                                        \
+        double ph = *phase;                                                                           \
+        for (int i = 0; i < frames; ++i)                                                              \
+        {                                                                                             \
+            double s = sin(ph) * amp;                                                                 \
+            for (int c = 0; c < ch; ++c, p += (BYTES))                                                \
+                STORE(p, s);                                                                          \
+            ph += step;                                                                               \
+        }                                                                                             \
+        *phase = fmod(ph, 2 * M_PI);                                                                  \
+    }
+#define KA_DEFINE_SINE_WRITERS(T, BYTES, STORE)      \
+    KA_DEFINE_SINE_WRITER(sine_##T##_n, BYTES, STORE, 0) \
+    KA_DEFINE_SINE_WRITER(sine_##T##_1, BYTES, STORE, 1) \
+    KA_DEFINE_SINE_WRITER(sine_##T##_2, BYTES, STORE, 2)
+
+KA_DEFINE_SINE_WRITERS(s16, 2, KA_STORE_S16)
+KA_DEFINE_SINE_WRITERS(f32, 4, KA_STORE_F32)
+KA_DEFINE_SINE_WRITERS(s24, 3, KA_STORE_S24)
+KA_DEFINE_SINE_WRITERS(s32, 4, KA_STORE_S32)
+
+typedef void (*SineWriterFn)(void *out, int frames, int channels, double *phase, double step, double amp);
+// [SampleType][0 = any channel count, 1, 2]
+static const SineWriterFn g_sineWriters[4][3] = {
+    {sine_s16_n, sine_s16_1, sine_s16_2},
+    {sine_f32_n, sine_f32_1, sine_f32_2},
+    {sine_s24_n, sine_s24_1, sine_s24_2},
+    {sine_s32_n, sine_s32_1, sine_s32_2},
+};
+static void fill_sine(SampleType t, void *out, int frames, int channels, double *phase, double step, double amp)
+{
+    g_sineWriters[t][channels <= 2 ? channels : 0](out, frames, channels, phase, step, amp);
+}
+// Scalar reference kernels (--kernel scalar, and what --bench compares the SIMD kernels against).
 static void fill_sine_i16(int16_t *out, int frames, int channels, double *phase, double step, int16_t amp)
 {
-    for (int i = 0; i < frames; ++i)
+    fill_sine(SAMPLE_S16, out, frames, channels, phase, step, amp);
+}
+static void fill_sine_f32(float *out, int frames, int channels, double *phase, double step, float amp)
+{
+    fill_sine(SAMPLE_F32, out, frames, channels, phase, step, amp);
+}
+
+// SIMD kernels: a complex rotor per lane advanced by e^(i*lanes*step) each iteration, so the
+// inner loop is multiply/add only. The rotor is re-seeded from the exact phase every
+// KERNEL_BLOCK frames, which bounds float drift. Other channel counts use the scalar path.
+#define KERNEL_BLOCK 256 // frames between rotor re-seeds; a multiple of every lane count
+
+// Seed `lanes` consecutive rotor values starting at phase ph (cs/ss = cos/sin of step).
+static void rotor_seed(double ph, double cs, double ss, int lanes, float *re, float *im)
+{
+    double c = cos(ph), s = sin(ph);
+    for (int k = 0; k < lanes; ++k)
+    {
+        re[k] = (float)c;
+        im[k] = (float)s;
+        double t = c * cs - s * ss;
+        s = c * ss + s * cs;
+        c = t;
+    }
+}
+
+#ifdef KA_X86_SIMD
+KA_TARGET_SSE2 static void fill_sine_f32_sse2(float *out, int frames, int channels, double *phase, double step, float amp)
+{
+    if (channels > 2)
     {
-        int16_t s = (int16_t)(sin(*phase) * amp);
-        *phase += step;
-        if (*phase >= 2 * M_PI)
-            *phase -= 2 * M_PI;
+        fill_sine_f32(out, frames, channels, phase, step, amp);
+        return;
+    }
+    const __m128 cw = _mm_set1_ps((float)cos(4 * step)), sw = _mm_set1_ps((float)sin(4 * step));
+    const __m128 va = _mm_set1_ps(amp);
+    const double cs = cos(step), ss = sin(step);
+    double ph = *phase;
+    for (int i = 0; i < frames; i += KERNEL_BLOCK)
+    {
+        int n = min(KERNEL_BLOCK, frames - i), j = 0;
+        float r0[4], i0[4];
+        rotor_seed(ph, cs, ss, 4, r0, i0);
+        __m128 re = _mm_loadu_ps(r0), im = _mm_loadu_ps(i0);
+        float *o = out + (size_t)i * channels;
+#define KA_ROTATE_SSE()                                                  \
+    do                                                                   \
+    {                                                                    \
+        __m128 nre = _mm_sub_ps(_mm_mul_ps(re, cw), _mm_mul_ps(im, sw)); \
+        im = _mm_add_ps(_mm_mul_ps(re, sw), _mm_mul_ps(im, cw));         \
+        re = nre;                                                        \
+    } while (0)
         if (channels == 1)
-            out[i] = s;
+        {
+            for (; j + 4 <= n; j += 4)
+            {
+                _mm_storeu_ps(o + j, _mm_mul_ps(im, va));
+                KA_ROTATE_SSE();
+            }
+        }
         else
         {
-            out[2 * i] = s;
-            out[2 * i + 1] = s;
+            for (; j + 4 <= n; j += 4)
+            {
+                __m128 v = _mm_mul_ps(im, va);
+                _mm_storeu_ps(o + 2 * j, _mm_unpacklo_ps(v, v));
+                _mm_storeu_ps(o + 2 * j + 4, _mm_unpackhi_ps(v, v));
+                KA_ROTATE_SSE();
+            }
+        }
+        if (j < n)
+        {
+            float t[4];
+            _mm_storeu_ps(t, _mm_mul_ps(im, va));
+            for (int k = 0; j < n; ++j, ++k)
+                for (int c = 0; c < channels; ++c)
+                    o[j * channels + c] = t[k];
         }
+        ph += n * step;
     }
+    *phase = fmod(ph, 2 * M_PI);
 }
-static void fill_sine_f32(float *out, int frames, int channels, double *phase, double step, float amp)
+KA_TARGET_SSE2 static void fill_sine_i16_sse2(int16_t *out, int frames, int channels, double *phase, double step, int16_t amp)
 {
-    for (int i = 0; i < frames; ++i)
+    if (channels > 2)
     {
-        float s = (float)(sin(*phase) * amp);
-        *phase += step;
-        if (*phase >= 2 * M_PI)
-            *phase -= 2 * M_PI;
+        fill_sine_i16(out, frames, channels, phase, step, amp);
+        return;
+    }
+    const __m128 cw = _mm_set1_ps((float)cos(4 * step)), sw = _mm_set1_ps((float)sin(4 * step));
+    const __m128 va = _mm_set1_ps((float)amp);
+    const double cs = cos(step), ss = sin(step);
+    double ph = *phase;
+    for (int i = 0; i < frames; i += KERNEL_BLOCK)
+    {
+        int n = min(KERNEL_BLOCK, frames - i), j = 0;
+        float r0[4], i0[4];
+        rotor_seed(ph, cs, ss, 4, r0, i0);
+        __m128 re = _mm_loadu_ps(r0), im = _mm_loadu_ps(i0);
+        int16_t *o = out + (size_t)i * channels;
         if (channels == 1)
-            out[i] = s;
+        {
+            for (; j + 4 <= n; j += 4)
+            {
+                __m128i p = _mm_cvttps_epi32(_mm_mul_ps(im, va));
+                _mm_storel_epi64((__m128i *)(o + j), _mm_packs_epi32(p, p));
+                KA_ROTATE_SSE();
+            }
+        }
         else
         {
-            out[2 * i] = s;
-            out[2 * i + 1] = s;
+            for (; j + 4 <= n; j += 4)
+            {
+                __m128i p = _mm_cvttps_epi32(_mm_mul_ps(im, va));
+                p = _mm_packs_epi32(p, p);
+                _mm_storeu_si128((__m128i *)(o + 2 * j), _mm_unpacklo_epi16(p, p));
+                KA_ROTATE_SSE();
+            }
+        }
+#undef KA_ROTATE_SSE
+        if (j < n)
+        {
+            float t[4];
+            _mm_storeu_ps(t, _mm_mul_ps(im, va));
+            for (int k = 0; j < n; ++j, ++k)
+                for (int c = 0; c < channels; ++c)
+                    o[j * channels + c] = (int16_t)t[k];
         }
+        ph += n * step;
     }
+    *phase = fmod(ph, 2 * M_PI);
 }
 
-// Audio worker thread
-static DWORD WINAPI AudioThreadProc(LPVOID lp)
+#define KA_ROTATE_AVX()                                                           \
+    do                                                                            \
+    {                                                                             \
+        __m256 nre = _mm256_sub_ps(_mm256_mul_ps(re, cw), _mm256_mul_ps(im, sw)); \
+        im = _mm256_add_ps(_mm256_mul_ps(re, sw), _mm256_mul_ps(im, cw));         \
+        re = nre;                                                                 \
+    } while (0)
+KA_TARGET_AVX2 static void fill_sine_f32_avx2(float *out, int frames, int channels, double *phase, double step, float amp)
 {
-    double lin = pow(10.0, g_db / 20.0);
-    int bytesPerFrame; // derived from opened format
-    bytesPerFrame = (g_usingFloat ? (int)(g_channels * 4) : (int)(g_channels * 2));
-
-    // Prime and loop: headers already prepared/written by main before thread start.
-    while (InterlockedCompareExchange(&g_running, 1, 1))
+    if (channels > 2)
+    {
+        fill_sine_f32(out, frames, channels, phase, step, amp);
+        return;
+    }
+    const __m256 cw = _mm256_set1_ps((float)cos(8 * step)), sw = _mm256_set1_ps((float)sin(8 * step));
+    const __m256 va = _mm256_set1_ps(amp);
+    const double cs = cos(step), ss = sin(step);
+    double ph = *phase;
+    for (int i = 0; i < frames; i += KERNEL_BLOCK)
     {
-        for (int i = 0; i < g_numBuffers; ++i)
+        int n = min(KERNEL_BLOCK, frames - i), j = 0;
+        float r0[8], i0[8];
+        rotor_seed(ph, cs, ss, 8, r0, i0);
+        __m256 re = _mm256_loadu_ps(r0), im = _mm256_loadu_ps(i0);
+        float *o = out + (size_t)i * channels;
+        if (channels == 1)
         {
-            if (g_headers[i].dwFlags & WHDR_DONE)
+            for (; j + 8 <= n; j += 8)
             {
-                if (g_usingFloat)
-                {
-                    float amp = (float)lin;
-                    fill_sine_f32((float *)g_headers[i].lpData, g_bufferFrames, g_channels, &g_phase, g_phaseStep, amp);
-                }
-                else
-                {
-                    double scaled = lin * 32767.0;
-                    if (scaled < 1.0)
-                        scaled = 1.0;
-                    if (scaled > 32767.0)
-                        scaled = 32767.0;
-                    int16_t amp = (int16_t)floor(scaled + 0.5);
-                    fill_sine_i16((int16_t *)g_headers[i].lpData, g_bufferFrames, g_channels, &g_phase, g_phaseStep, amp);
-                }
-                MMRESULT mmr = waveOutWrite(g_hwo, &g_headers[i], sizeof(WAVEHDR));
-                if (mmr != MMSYSERR_NOERROR)
-                {
-                    dlog("waveOutWrite failed in loop: %u\n", (unsigned)mmr);
-                    InterlockedExchange(&g_running, 0);
-                    break;
-                }
+                _mm256_storeu_ps(o + j, _mm256_mul_ps(im, va));
+                KA_ROTATE_AVX();
+            }
+        }
+        else
+        {
+            for (; j + 8 <= n; j += 8)
+            {
+                // unpack works per 128-bit lane: lo = s0 s0 s1 s1 | s4 s4 s5 s5, hi = s2 s2 s3 s3 | s6 s6 s7 s7
+                __m256 v = _mm256_mul_ps(im, va);
+                __m256 lo = _mm256_unpacklo_ps(v, v), hi = _mm256_unpackhi_ps(v, v);
+                _mm256_storeu_ps(o + 2 * j, _mm256_permute2f128_ps(lo, hi, 0x20));
+                _mm256_storeu_ps(o + 2 * j + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+                KA_ROTATE_AVX();
             }
         }
-        Sleep(5);
+        if (j < n)
+        {
+            float t[8];
+            _mm256_storeu_ps(t, _mm256_mul_ps(im, va));
+            for (int k = 0; j < n; ++j, ++k)
+                for (int c = 0; c < channels; ++c)
+                    o[j * channels + c] = t[k];
+        }
+        ph += n * step;
     }
-    return 0;
+    *phase = fmod(ph, 2 * M_PI);
 }
-
-// Hidden message window to catch WM_ENDSESSION cleanly
-static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+KA_TARGET_AVX2 static void fill_sine_i16_avx2(int16_t *out, int frames, int channels, double *phase, double step, int16_t amp)
 {
-    switch (msg)
+    if (channels > 2)
     {
-    case WM_ENDSESSION:
-        InterlockedExchange(&g_running, 0);
-        return 0;
-    case WM_CLOSE:
-    case WM_QUIT:
-        InterlockedExchange(&g_running, 0);
-        return 0;
-    default:
-        return DefWindowProc(hwnd, msg, wParam, lParam);
+        fill_sine_i16(out, frames, channels, phase, step, amp);
+        return;
     }
+    const __m256 cw = _mm256_set1_ps((float)cos(8 * step)), sw = _mm256_set1_ps((float)sin(8 * step));
+    const __m256 va = _mm256_set1_ps((float)amp);
+    const double cs = cos(step), ss = sin(step);
+    double ph = *phase;
+    for (int i = 0; i < frames; i += KERNEL_BLOCK)
+    {
+        int n = min(KERNEL_BLOCK, frames - i), j = 0;
+        float r0[8], i0[8];
+        rotor_seed(ph, cs, ss, 8, r0, i0);
+        __m256 re = _mm256_loadu_ps(r0), im = _mm256_loadu_ps(i0);
+        int16_t *o = out + (size_t)i * channels;
+        if (channels == 1)
+        {
+            for (; j + 8 <= n; j += 8)
+            {
+                __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(im, va));
+                __m128i p = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+                _mm_storeu_si128((__m128i *)(o + j), p);
+                KA_ROTATE_AVX();
+            }
+        }
+        else
+        {
+            for (; j + 8 <= n; j += 8)
+            {
+                __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(im, va));
+                __m128i p = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+                _mm_storeu_si128((__m128i *)(o + 2 * j), _mm_unpacklo_epi16(p, p));
+                _mm_storeu_si128((__m128i *)(o + 2 * j + 8), _mm_unpackhi_epi16(p, p));
+                KA_ROTATE_AVX();
+            }
+        }
+        if (j < n)
+        {
+            float t[8];
+            _mm256_storeu_ps(t, _mm256_mul_ps(im, va));
+            for (int k = 0; j < n; ++j, ++k)
+                for (int c = 0; c < channels; ++c)
+                    o[j * channels + c] = (int16_t)t[k];
+        }
+        ph += n * step;
+    }
+    *phase = fmod(ph, 2 * M_PI);
+}
+#undef KA_ROTATE_AVX
+
+static void cpuid_ex(int leaf, int sub, int r[4])
+{
+#ifdef _MSC_VER
+    __cpuidex(r, leaf, sub);
+#else
+    __cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+static unsigned long long xgetbv0(void)
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+static BOOL cpu_has_kernel(FillKernelId id)
+{
+    int r[4];
+    cpuid_ex(0, 0, r);
+    int maxLeaf = r[0];
+    cpuid_ex(1, 0, r);
+    if (id == KERNEL_SSE2)
+        return (r[3] & (1 << 26)) != 0;
+    // AVX2 also needs the OS to save YMM state (OSXSAVE + XCR0 bits 1..2).
+    if (!(r[2] & (1 << 27)) || (xgetbv0() & 6) != 6 || maxLeaf < 7)
+        return FALSE;
+    cpuid_ex(7, 0, r);
+    return (r[1] & (1 << 5)) != 0;
+}
+#else
+static BOOL cpu_has_kernel(FillKernelId id)
+{
+    return FALSE;
+}
+#endif
+
+typedef void (*FillI16Fn)(int16_t *out, int frames, int channels, double *phase, double step, int16_t amp);
+typedef void (*FillF32Fn)(float *out, int frames, int channels, double *phase, double step, float amp);
+typedef struct
+{
+    const char *name;
+    FillI16Fn i16;
+    FillF32Fn f32;
+} FillKernel;
+// Indexed by FillKernelId; entries the CPU/build lacks are never selected.
+static const FillKernel g_kernels[] = {
+    {"auto", fill_sine_i16, fill_sine_f32},
+    {"scalar", fill_sine_i16, fill_sine_f32},
+#ifdef KA_X86_SIMD
+    {"sse2", fill_sine_i16_sse2, fill_sine_f32_sse2},
+    {"avx2", fill_sine_i16_avx2, fill_sine_f32_avx2},
+#else
+    {"sse2", fill_sine_i16, fill_sine_f32},
+    {"avx2", fill_sine_i16, fill_sine_f32},
+#endif
+};
+static const FillKernel *g_kernel = &g_kernels[KERNEL_SCALAR];
+
+static BOOL kernel_supported(FillKernelId id)
+{
+    return id == KERNEL_SCALAR || ((id == KERNEL_SSE2 || id == KERNEL_AVX2) && cpu_has_kernel(id));
+}
+// Resolve --kernel: auto = best the CPU runs; an unsupported request falls back the same way.
+static void select_kernel(FillKernelId want)
+{
+    FillKernelId best = kernel_supported(KERNEL_AVX2) ? KERNEL_AVX2 : (kernel_supported(KERNEL_SSE2) ? KERNEL_SSE2 : KERNEL_SCALAR);
+    FillKernelId use = want;
+    if (want == KERNEL_AUTO || !kernel_supported(want))
+    {
+        if (want != KERNEL_AUTO)
+            dlog("Kernel %s not supported on this CPU/build; using %s\n", g_kernels[want].name, g_kernels[best].name);
+        use = best;
+    }
+    g_kernel = &g_kernels[use];
+    dlog("Fill kernel: %s\n", g_kernel->name);
+}
+
+static long long gcd_ll(long long a, long long b)
+{
+    while (b)
+    {
+        long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Smallest frame count holding a whole number of tone cycles, or 0 if the frequency
+// is not an exact multiple of 1 mHz (then the period may never repeat exactly).
+static long long tone_period_frames(double freq, int rate)
+{
+    long long milliHz = llround(freq * 1000.0);
+    if (milliHz <= 0 || fabs((double)milliHz / 1000.0 - freq) > 1e-9)
+        return 0;
+    long long den = (long long)rate * 1000;
+    return den / gcd_ll(den, milliHz);
+}
+
+// Render one exact period into st->lut. Phase comes from integer frame index, so the
+// table wraps without a discontinuity and carries no accumulator drift.
+static void store_sample(SampleType t, uint8_t *p, double v)
+{
+    switch (t)
+    {
+    case SAMPLE_S16:
+        KA_STORE_S16(p, v);
+        break;
+    case SAMPLE_F32:
+        KA_STORE_F32(p, v);
+        break;
+    case SAMPLE_S24:
+        KA_STORE_S24(p, v);
+        break;
+    default:
+        KA_STORE_S32(p, v);
+        break;
+    }
+}
+
+static int sample_bytes(SampleType t)
+{
+    return (t == SAMPLE_S16) ? 2 : (t == SAMPLE_S24) ? 3 : 4;
+}
+static const char *sample_name(SampleType t)
+{
+    static const char *names[] = {"pcm16", "float32", "pcm24", "pcm32"};
+    return names[t];
+}
+// Peak for a dBFS level in the sample type's units; PCM keeps at least 1 LSB so the tone never rounds away.
+static double sample_amplitude(SampleType t, double db)
+{
+    double lin = pow(10.0, db / 20.0);
+    if (t == SAMPLE_F32)
+        return lin;
+    double full = (t == SAMPLE_S16) ? 32767.0 : (t == SAMPLE_S24) ? 8388607.0 : 2147483647.0;
+    double scaled = floor(lin * full + 0.5);
+    if (scaled < 1.0)
+        scaled = 1.0;
+    if (scaled > full)
+        scaled = full;
+    return scaled;
+}
+
+#define PULSE_MS 1                     // pulse length; at --db -100 in PCM that is a run of 1 LSB
+#define PULSE_DEFAULT_INTERVAL_MS 1000 // when neither --interval nor a calibration result exists
+#define PULSE_MIN_INTERVAL_MS 50
+#define PULSE_MAX_INTERVAL_MS 600000
+#define PULSE_INTERVAL_KEY L"Software\\KeepAudio\\PulseInterval" // REG_DWORD ms per endpoint ID (--calibrate)
+#define SOAK_KEY L"Software\\KeepAudio\\Soak"                   // REG_DWORD kframes/s baseline per fill path (--soak)
+static volatile LONG g_pulseOverrideMs = 0; // --calibrate: interval under test, applied by the worker
+
+// TRUE when [pulsePos, pulsePos + frames) touches a pulse.
+static BOOL pulse_due(const AudioStream *st, int frames)
+{
+    int pos = st->pulsePos % st->pulseInterval;
+    return pos < st->pulseFrames || st->pulseInterval - pos < frames;
+}
+
+// Keep-alive pattern. Buffers are digital zero apart from the pulse, so a buffer that held
+// no pulse (dirty = FALSE) is left untouched and the worker does no per-sample work for it.
+// out = NULL only advances the position. Returns TRUE when the span contains a pulse.
+static BOOL pulse_fill(AudioStream *st, void *out, int frames, BOOL dirty)
+{
+    LONG overrideMs = g_pulseOverrideMs;
+    if (overrideMs > 0)
+        st->pulseInterval = max(st->pulseFrames + 1, (int)((LONGLONG)st->rate * overrideMs / 1000));
+    int bytesPerFrame = st->channels * sample_bytes(st->sample);
+    BOOL due = pulse_due(st, frames);
+    if (out && (dirty || due))
+        memset(out, 0, (size_t)frames * bytesPerFrame);
+    if (out && due)
+    {
+        uint8_t *p = (uint8_t *)out;
+        for (int k = 0; k < frames; ++k, p += bytesPerFrame)
+        {
+            if ((st->pulsePos + k) % st->pulseInterval >= st->pulseFrames)
+                continue;
+            for (int c = 0; c < st->channels; ++c)
+                store_sample(st->sample, p + c * sample_bytes(st->sample), st->amp);
+        }
+    }
+    st->pulsePos = (int)(((LONGLONG)st->pulsePos + frames) % st->pulseInterval);
+    return due;
+}
+
+// Endpoint ID a stream plays to, for per-device settings. Default-device streams resolve
+// to the current default (WASAPI) or the waveOut preferred device (winmm).
+static BOOL stream_endpoint(const AudioStream *st, wchar_t *buf, size_t cap)
+{
+    LPWSTR id = NULL;
+    buf[0] = L'\0';
+    if (st->endpointId[0])
+    {
+        wcsncpy(buf, st->endpointId, cap);
+    }
+    else if (st->backend == BACKEND_WASAPI && st->mmDevice && SUCCEEDED(IMMDevice_GetId(st->mmDevice, &id)))
+    {
+        wcsncpy(buf, id, cap);
+        CoTaskMemFree(id);
+    }
+    else if (st->backend == BACKEND_WINMM)
+    {
+        winmm_default_endpoint_id(buf, cap);
+    }
+    buf[cap - 1] = L'\0';
+    return buf[0] != L'\0';
+}
+static DWORD load_pulse_interval(const wchar_t *endpoint)
+{
+    DWORD v = 0, bytes = sizeof(v);
+    if (RegGetValueW(HKEY_CURRENT_USER, PULSE_INTERVAL_KEY, endpoint, RRF_RT_REG_DWORD, NULL, &v, &bytes) != ERROR_SUCCESS)
+        return 0;
+    return v;
+}
+static void store_pulse_interval(const wchar_t *endpoint, DWORD ms)
+{
+    HKEY hKey = NULL;
+    if (RegCreateKeyExW(HKEY_CURRENT_USER, PULSE_INTERVAL_KEY, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL) != ERROR_SUCCESS)
+        return;
+    RegSetValueExW(hKey, endpoint, 0, REG_DWORD, (const BYTE *)&ms, sizeof(ms));
+    RegCloseKey(hKey);
+}
+
+// Pulse geometry once the rate and sample format are known.
+static void pulse_setup(AudioStream *st, const Options *opt)
+{
+    wchar_t endpoint[256];
+    st->pulse = (opt->synth == SYNTH_PULSE);
+    if (!st->pulse)
+        return;
+    DWORD ms = (DWORD)opt->intervalMs;
+    const char *source = "--interval";
+    if (ms == 0 && stream_endpoint(st, endpoint, _countof(endpoint)) && (ms = load_pulse_interval(endpoint)) != 0)
+        source = "calibrated";
+    if (ms == 0)
+    {
+        ms = PULSE_DEFAULT_INTERVAL_MS;
+        source = "default";
+    }
+    ms = (DWORD)clamp_int((int)ms, PULSE_MIN_INTERVAL_MS, PULSE_MAX_INTERVAL_MS);
+    st->pulseFrames = max(1, st->rate * PULSE_MS / 1000);
+    st->pulseInterval = max(st->pulseFrames + 1, (int)((LONGLONG)st->rate * ms / 1000));
+    st->pulsePos = 0;
+    dlog("[dev %d] keep-alive pulse: %d frames every %lu ms (%s)\n", st->deviceIndex, st->pulseFrames, (unsigned long)ms, source);
+}
+
+// One exact period of the tone in the stream's sample format (channels, sample, amp), starting
+// at st->phase (0 at open; the current phase when retuned).
+static BOOL build_tone_lut(AudioStream *st, double freq, int rate)
+{
+    long long frames = tone_period_frames(freq, rate);
+    int sampleBytes = sample_bytes(st->sample);
+    int bytesPerFrame = st->channels * sampleBytes;
+    if (frames <= 0 || frames * bytesPerFrame > LUT_MAX_BYTES)
+        return FALSE;
+    long long cycles = (long long)llround(freq * 1000.0) * frames / ((long long)rate * 1000);
+    st->lut = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)(frames * bytesPerFrame));
+    if (!st->lut)
+        return FALSE;
+    uint8_t *p = (uint8_t *)st->lut;
+    for (long long k = 0; k < frames; ++k)
+    {
+        double v = sin(2.0 * M_PI * (double)((k * cycles) % frames) / (double)frames + st->phase) * st->amp;
+        for (int c = 0; c < st->channels; ++c, p += sampleBytes)
+            store_sample(st->sample, p, v);
+    }
+    st->lutFrames = (int)frames;
+    st->lutCycles = cycles;
+    st->lutPos = 0;
+    return TRUE;
+}
+
+// Find a frames x buffers geometry (within the --frames/--buffers clamps) whose total is a
+// whole number of tone periods. Smallest multiple wins; then frames closest to the request.
+static BOOL pick_static_tiling(long long period, int reqFrames, int reqBuffers, int *outFrames, int *outBuffers)
+{
+    if (period <= 0)
+        return FALSE;
+    for (long long total = period; total <= 32LL * 8192; total += period)
+    {
+        long long bestScore = -1;
+        for (int k = 2; k <= 32; ++k)
+        {
+            if (total % k)
+                continue;
+            long long n = total / k;
+            if (n < 128 || n > 8192)
+                continue;
+            long long score = llabs(n - reqFrames) * 64 + llabs((long long)k - reqBuffers);
+            if (bestScore < 0 || score < bestScore)
+            {
+                bestScore = score;
+                *outFrames = (int)n;
+                *outBuffers = k;
+            }
+        }
+        if (bestScore >= 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void fill_from_lut(AudioStream *st, void *out, int frames, int bytesPerFrame)
+{
+    char *dst = (char *)out;
+    while (frames > 0)
+    {
+        int n = st->lutFrames - st->lutPos;
+        if (n > frames)
+            n = frames;
+        memcpy(dst, (const char *)st->lut + (size_t)st->lutPos * bytesPerFrame, (size_t)n * bytesPerFrame);
+        dst += (size_t)n * bytesPerFrame;
+        frames -= n;
+        st->lutPos += n;
+        if (st->lutPos == st->lutFrames)
+            st->lutPos = 0;
+    }
+}
+
+// Fill frames from the table when available, otherwise synthesize.
+static BOOL pulse_fill(AudioStream *st, void *out, int frames, BOOL dirty);
+
+static void fill_frames(AudioStream *st, void *out, int frames)
+{
+    if (st->pulse)
+        pulse_fill(st, out, frames, TRUE);
+    else if (st->lut)
+        fill_from_lut(st, out, frames, st->channels * sample_bytes(st->sample));
+    else if (st->sample == SAMPLE_F32)
+        g_kernel->f32((float *)out, frames, st->channels, &st->phase, st->phaseStep, (float)st->amp);
+    else if (st->sample == SAMPLE_S16)
+        g_kernel->i16((int16_t *)out, frames, st->channels, &st->phase, st->phaseStep, (int16_t)st->amp);
+    else
+        fill_sine(st->sample, out, frames, st->channels, &st->phase, st->phaseStep, st->amp);
+}
+static void fill_buffer(AudioStream *st, void *out)
+{
+    fill_frames(st, out, st->bufferFrames);
+}
+// winmm: in pulse mode dwUser records whether the header's buffer holds a pulse.
+static void fill_header(AudioStream *st, WAVEHDR *h)
+{
+    if (st->pulse)
+        h->dwUser = pulse_fill(st, h->lpData, st->bufferFrames, h->dwUser != 0);
+    else
+        fill_buffer(st, h->lpData);
+}
+
+// WASAPI: top up whatever the engine consumed since the last event.
+static void note_refill(AudioStream *st, double wakeMs);
+
+static BOOL wasapi_refill(AudioStream *st, double wakeMs)
+{
+    UINT32 padding = 0;
+    BYTE *data = NULL;
+    // Exclusive event mode ping-pongs whole buffers; padding is not meaningful there.
+    HRESULT hr = st->wasapiExclusive ? S_OK : IAudioClient_GetCurrentPadding(st->audioClient, &padding);
+    if (FAILED(hr))
+    {
+        dlog("WASAPI GetCurrentPadding failed: 0x%08lx\n", (unsigned long)hr);
+        return FALSE;
+    }
+    UINT32 avail = st->wasapiFrames - padding;
+    if (avail == 0)
+        return TRUE;
+    if (!st->wasapiExclusive && padding == 0)
+    {
+        ++st->lateRefills;
+        KA_TRACE("LateRefill", WINEVENT_LEVEL_WARNING, KA_KW_BUFFER, TraceLoggingInt32(st->deviceIndex, "Device"),
+                 TraceLoggingInt64(st->lateRefills, "LateRefills"));
+    }
+    hr = IAudioRenderClient_GetBuffer(st->renderClient, avail, &data);
+    if (FAILED(hr))
+    {
+        dlog("WASAPI GetBuffer failed: 0x%08lx\n", (unsigned long)hr);
+        return FALSE;
+    }
+    DWORD flags = 0;
+    if (st->pulse && !pulse_due(st, (int)avail))
+    {
+        // All zero: let the engine treat it as silence instead of writing it.
+        pulse_fill(st, NULL, (int)avail, FALSE);
+        flags = AUDCLNT_BUFFERFLAGS_SILENT;
+    }
+    else
+    {
+        fill_frames(st, data, (int)avail);
+    }
+    st->framesQueued += avail;
+    hr = IAudioRenderClient_ReleaseBuffer(st->renderClient, avail, flags);
+    if (FAILED(hr))
+    {
+        dlog("WASAPI ReleaseBuffer failed: 0x%08lx\n", (unsigned long)hr);
+        return FALSE;
+    }
+    KA_TRACE("BufferSubmit", WINEVENT_LEVEL_VERBOSE, KA_KW_BUFFER, TraceLoggingInt32(st->deviceIndex, "Device"),
+             TraceLoggingUInt32(avail, "Frames"), TraceLoggingUInt32(padding, "Queued"));
+    note_refill(st, wakeMs);
+    return TRUE;
+}
+
+// Endpoint watcher: a static IMMNotificationClient. Callbacks run on an MMDevice thread,
+// so they only record what happened and wake the worker, which does the reopening.
+static HRESULT STDMETHODCALLTYPE watcher_QueryInterface(IMMNotificationClient *This, REFIID riid, void **ppv)
+{
+    if (IsEqualIID(riid, &KA_IID_IUnknown) || IsEqualIID(riid, &KA_IID_IMMNotificationClient))
+    {
+        *ppv = This;
+        return S_OK;
+    }
+    *ppv = NULL;
+    return E_NOINTERFACE;
+}
+static ULONG STDMETHODCALLTYPE watcher_AddRef(IMMNotificationClient *This)
+{
+    return 1;
+}
+static ULONG STDMETHODCALLTYPE watcher_Release(IMMNotificationClient *This)
+{
+    return 1;
+}
+// Hand DEVEV_* bits to the worker (endpoint watcher and power notifications).
+static void signal_worker(LONG bits)
+{
+    InterlockedOr(&g_deviceEvents, bits);
+    if (g_deviceChangeEvent)
+        SetEvent(g_deviceChangeEvent);
+}
+static HRESULT STDMETHODCALLTYPE watcher_OnDeviceStateChanged(IMMNotificationClient *This, LPCWSTR id, DWORD state)
+{
+    signal_worker(DEVEV_STATE);
+    return S_OK;
+}
+static HRESULT STDMETHODCALLTYPE watcher_OnDeviceAdded(IMMNotificationClient *This, LPCWSTR id)
+{
+    signal_worker(DEVEV_STATE);
+    return S_OK;
+}
+static HRESULT STDMETHODCALLTYPE watcher_OnDeviceRemoved(IMMNotificationClient *This, LPCWSTR id)
+{
+    signal_worker(DEVEV_STATE);
+    return S_OK;
+}
+static HRESULT STDMETHODCALLTYPE watcher_OnDefaultDeviceChanged(IMMNotificationClient *This, EDataFlow flow, ERole role, LPCWSTR id)
+{
+    if (flow == eRender && role == eConsole)
+        signal_worker(DEVEV_DEFAULT);
+    return S_OK;
+}
+static HRESULT STDMETHODCALLTYPE watcher_OnPropertyValueChanged(IMMNotificationClient *This, LPCWSTR id, const PROPERTYKEY key)
+{
+    return S_OK;
+}
+static IMMNotificationClientVtbl g_watcherVtbl = {
+    watcher_QueryInterface, watcher_AddRef, watcher_Release, watcher_OnDeviceStateChanged, watcher_OnDeviceAdded,
+    watcher_OnDeviceRemoved, watcher_OnDefaultDeviceChanged, watcher_OnPropertyValueChanged};
+static IMMNotificationClient g_watcher = {&g_watcherVtbl};
+
+static BOOL open_stream_winmm(AudioStream *st, const Options *opt);
+static BOOL open_stream_wasapi(AudioStream *st, const Options *opt);
+static void close_stream(AudioStream *st);
+static void join_request(void);
+static void control_request(void);
+static void profiles_request(void);
+static void profiles_apply(void);
+static void stream_set_paused(AudioStream *st, BOOL pause, const char *why);
+
+// Remember which endpoint a freshly opened stream landed on. A winmm default-device stream
+// records where the mapper sent it, so it matches requests for that endpoint by ID.
+static void record_endpoint_id(AudioStream *st)
+{
+    st->endpointId[0] = L'\0';
+    if (st->backend == BACKEND_WASAPI)
+    {
+        LPWSTR id = NULL;
+        if (st->mmDevice && SUCCEEDED(IMMDevice_GetId(st->mmDevice, &id)))
+        {
+            wcsncpy(st->endpointId, id, _countof(st->endpointId));
+            st->endpointId[_countof(st->endpointId) - 1] = L'\0';
+            CoTaskMemFree(id);
+        }
+    }
+    else if (st->deviceIndex >= 0)
+    {
+        winmm_endpoint_id((UINT)st->deviceIndex, st->endpointId, _countof(st->endpointId));
+    }
+    else
+    {
+        winmm_default_endpoint_id(st->endpointId, _countof(st->endpointId));
+    }
+}
+
+static void trace_open(const AudioStream *st, const char *why)
+{
+    KA_TRACE("DeviceOpen", WINEVENT_LEVEL_INFO, KA_KW_DEVICE, TraceLoggingInt32(st->deviceIndex, "Device"),
+             TraceLoggingWideString(st->endpointId, "Endpoint"),
+             TraceLoggingString(st->backend == BACKEND_WASAPI ? (st->wasapiExclusive ? "wasapi-exclusive" : "wasapi") : "winmm",
+                                "Backend"),
+             TraceLoggingInt32(st->rate, "Rate"), TraceLoggingInt32(st->channels, "Channels"),
+             TraceLoggingString(sample_name(st->sample), "Sample"),
+             TraceLoggingUInt32((UINT32)(st->backend == BACKEND_WASAPI ? st->wasapiFrames : st->bufferFrames), "BufferFrames"),
+             TraceLoggingString(why, "Reason"));
+}
+
+static void stream_lost(AudioStream *st)
+{
+    close_stream(st);
+    st->active = FALSE;
+    st->lost = TRUE;
+    st->lostAtMs = now_ms();
+}
+
+// Reopen a stream on its endpoint: found again by ID when known (indexes shift on hot-plug),
+// the current default for default-device streams, else the original index.
+static BOOL reopen_stream(AudioStream *st, const char *why)
+{
+    double t0 = now_ms();
+    close_stream(st);
+    st->active = FALSE;
+    if (st->deviceIndex >= 0 && st->endpointId[0])
+    {
+        if (!mm_endpoint_active(st->endpointId))
+            goto fail;
+        int idx = (st->backend == BACKEND_WASAPI) ? mm_index_for_endpoint(st->endpointId) : winmm_index_for_endpoint(st->endpointId);
+        if (idx < 0)
+            goto fail;
+        st->deviceIndex = idx;
+    }
+    BOOL ok = (st->backend == BACKEND_WASAPI) ? open_stream_wasapi(st, st->opt) : open_stream_winmm(st, st->opt);
+    if (!ok)
+        goto fail;
+    double t1 = now_ms();
+    if (st->lost)
+        dlog("[dev %d] reopened (%s): close %.1f ms, open took %.1f ms, %.1f ms after the device was lost\n",
+             st->deviceIndex, why, st->closeUs / 1000.0, t1 - t0, t1 - st->lostAtMs);
+    else
+        dlog("[dev %d] reopened (%s): close %.1f ms, open took %.1f ms\n", st->deviceIndex, why, st->closeUs / 1000.0,
+             t1 - t0);
+    record_endpoint_id(st);
+    trace_open(st, why);
+    st->active = TRUE;
+    st->lost = FALSE;
+    ++st->reconnects;
+    if (g_held)
+        stream_set_paused(st, TRUE, "held by the control pipe");
+    return TRUE;
+fail:
+    close_stream(st);
+    if (!st->lost)
+    {
+        st->lost = TRUE;
+        st->lostAtMs = t0;
+    }
+    return FALSE;
+}
+
+static BOOL power_wants_streams(void)
+{
+    if (g_systemSleeping)
+        return FALSE;
+    switch (g_config.powerPolicy)
+    {
+    case POWER_AC:
+        return g_onAc;
+    case POWER_DISPLAY:
+        return g_displayOn;
+    case POWER_AC_OR_DISPLAY:
+        return g_onAc || g_displayOn;
+    default:
+        return TRUE;
+    }
+}
+
+// Close every stream when sleeping or when --power-policy says the device may idle;
+// reopen them (on their endpoints, as after hot-plug) once it no longer does.
+static void apply_power_state(void)
+{
+    BOOL want = power_wants_streams();
+    if (!want && !g_streamsSuspended)
+    {
+        for (int i = 0; i < g_numStreams; ++i)
+        {
+            close_stream(&g_streams[i]);
+            g_streams[i].active = FALSE;
+            g_streams[i].lost = FALSE;
+        }
+        g_streamsSuspended = TRUE;
+        dlog("Power: streams closed (%s, %s, display %s)\n", g_systemSleeping ? "sleeping" : "awake", g_onAc ? "AC" : "battery",
+             g_displayOn ? "on" : "off");
+    }
+    else if (want && g_streamsSuspended)
+    {
+        g_streamsSuspended = FALSE;
+        for (int i = 0; i < g_numStreams; ++i)
+            reopen_stream(&g_streams[i], "power state");
+    }
+}
+
+// Worker side of the endpoint watcher and power notifications.
+static void handle_device_events(void)
+{
+    LONG ev = InterlockedExchange(&g_deviceEvents, 0);
+    if (ev & (DEVEV_POWER | DEVEV_RESUME))
+    {
+        BOOL wasSuspended = g_streamsSuspended;
+        apply_power_state();
+        if (g_powerAck)
+            SetEvent(g_powerAck);
+        // Slept without a suspend notice (or the streams stayed up): the handles may be stale.
+        if ((ev & DEVEV_RESUME) && !wasSuspended && !g_streamsSuspended)
+        {
+            for (int i = 0; i < g_numStreams; ++i)
+                if (g_streams[i].active)
+                    reopen_stream(&g_streams[i], "resume");
+        }
+    }
+    if (ev & DEVEV_JOIN)
+        join_request();
+    if (ev & DEVEV_CONTROL)
+        control_request();
+    if (ev & DEVEV_PROFILES)
+        profiles_request();
+    else if ((ev & DEVEV_STATE) && g_numProfiles)
+        profiles_apply(); // a section's endpoint may just have arrived
+    if (g_streamsSuspended)
+        return;
+    for (int i = 0; i < g_numStreams; ++i)
+    {
+        AudioStream *st = &g_streams[i];
+        if (st->lost)
+        {
+            reopen_stream(st, "endpoint available");
+        }
+        else if ((ev & DEVEV_DEFAULT) && st->deviceIndex < 0)
+        {
+            reopen_stream(st, "default device changed");
+        }
+        else if ((ev & DEVEV_STATE) && st->active && st->endpointId[0] && !mm_endpoint_active(st->endpointId))
+        {
+            // winmm may just stop completing headers on unplug instead of failing a write.
+            dlog("[dev %d] endpoint removed\n", st->deviceIndex);
+            stream_lost(st);
+        }
+    }
+}
+
+// Service one stream after its event fired. FALSE = the stream is broken.
+static void note_refill(AudioStream *st, double wakeMs)
+{
+    LONGLONG us = (LONGLONG)((now_ms() - wakeMs) * 1000.0);
+    ++st->refills;
+    st->latencyTotalUs += us;
+    if (us > st->latencyMaxUs)
+        st->latencyMaxUs = us;
+}
+
+static void adapt_queue(AudioStream *st, int queued, double wakeMs);
+
+static BOOL service_stream(AudioStream *st)
+{
+    double wakeMs = now_ms();
+    if (st->backend == BACKEND_WASAPI)
+    {
+        return wasapi_refill(st, wakeMs);
+    }
+    int done = 0, queued = 0;
+    for (int i = 0; i < st->numBuffers; ++i)
+    {
+        if (st->headers[i].dwFlags & WHDR_DONE)
+        {
+            KA_TRACE("BufferDone", WINEVENT_LEVEL_VERBOSE, KA_KW_BUFFER, TraceLoggingInt32(st->deviceIndex, "Device"),
+                     TraceLoggingInt32(i, "Header"));
+            if (i >= st->targetBuffers)
+            {
+                // --adaptive shrink: retire the header instead of resubmitting it.
+                waveOutUnprepareHeader(st->hwo, &st->headers[i], sizeof(WAVEHDR));
+                st->headers[i].dwFlags = 0;
+                continue;
+            }
+            ++done;
+            if (!st->staticBuffers)
+                fill_header(st, &st->headers[i]);
+            else
+                st->staticNext = (st->staticNext + 1) % st->numBuffers;
+            MMRESULT mmr = waveOutWrite(st->hwo, &st->headers[i], sizeof(WAVEHDR));
+            if (mmr != MMSYSERR_NOERROR)
+            {
+                dlog("[dev %d] waveOutWrite failed in loop: %u\n", st->deviceIndex, (unsigned)mmr);
+                return FALSE;
+            }
+            st->framesQueued += st->bufferFrames;
+            KA_TRACE("BufferSubmit", WINEVENT_LEVEL_VERBOSE, KA_KW_BUFFER, TraceLoggingInt32(st->deviceIndex, "Device"),
+                     TraceLoggingUInt32((UINT32)st->bufferFrames, "Frames"), TraceLoggingInt32(i, "Header"));
+            note_refill(st, wakeMs);
+        }
+        else if (st->headers[i].dwFlags & WHDR_PREPARED)
+        {
+            ++queued;
+        }
+    }
+    // Every header back means the device played out the whole queue before we refilled it.
+    if (done > 0 && queued == 0)
+    {
+        ++st->lateRefills;
+        KA_TRACE("LateRefill", WINEVENT_LEVEL_WARNING, KA_KW_BUFFER, TraceLoggingInt32(st->deviceIndex, "Device"),
+                 TraceLoggingInt64(st->lateRefills, "LateRefills"));
+    }
+    if (st->opt->adaptive && !st->staticBuffers)
+        adapt_queue(st, queued, wakeMs);
+    return TRUE;
+}
+
+// --duty-cycle: TRUE when another process has an active, audible session on the stream's endpoint.
+static BOOL endpoint_busy(AudioStream *st)
+{
+    if (!st->sessionMgr)
+    {
+        IMMDevice *dev = NULL;
+        if (st->mmDevice)
+        {
+            dev = st->mmDevice;
+            IMMDevice_AddRef(dev);
+        }
+        else
+        {
+            dev = (st->deviceIndex >= 0 && st->endpointId[0]) ? mm_get_device_by_id(st->endpointId) : mm_get_render_device(-1);
+        }
+        if (!dev)
+            return FALSE;
+        IMMDevice_Activate(dev, &KA_IID_IAudioSessionManager2, CLSCTX_ALL, NULL, (void **)&st->sessionMgr);
+        IMMDevice_Release(dev);
+        if (!st->sessionMgr)
+            return FALSE;
+    }
+
+    IAudioSessionEnumerator *en = NULL;
+    int count = 0;
+    BOOL busy = FALSE;
+    if (FAILED(IAudioSessionManager2_GetSessionEnumerator(st->sessionMgr, &en)))
+        return FALSE;
+    IAudioSessionEnumerator_GetCount(en, &count);
+    for (int i = 0; i < count && !busy; ++i)
+    {
+        IAudioSessionControl *ctl = NULL;
+        IAudioSessionControl2 *ctl2 = NULL;
+        IAudioMeterInformation *meter = NULL;
+        AudioSessionState state = AudioSessionStateInactive;
+        DWORD pid = 0;
+        float peak = 0.0f;
+        if (FAILED(IAudioSessionEnumerator_GetSession(en, i, &ctl)))
+            continue;
+        IAudioSessionControl_GetState(ctl, &state);
+        if (state == AudioSessionStateActive &&
+            SUCCEEDED(IAudioSessionControl_QueryInterface(ctl, &KA_IID_IAudioSessionControl2, (void **)&ctl2)))
+        {
+            IAudioSessionControl2_GetProcessId(ctl2, &pid);
+            // Active alone is not enough: players keep idle sessions open. Require signal.
+            if (pid != GetCurrentProcessId() &&
+                SUCCEEDED(IAudioSessionControl_QueryInterface(ctl, &KA_IID_IAudioMeterInformation, (void **)&meter)))
+            {
+                if (SUCCEEDED(IAudioMeterInformation_GetPeakValue(meter, &peak)) && peak > ACTIVITY_PEAK)
+                    busy = TRUE;
+                IAudioMeterInformation_Release(meter);
+            }
+            IAudioSessionControl2_Release(ctl2);
+        }
+        IAudioSessionControl_Release(ctl);
+    }
+    IAudioSessionEnumerator_Release(en);
+    return busy;
+}
+
+static void stream_set_paused(AudioStream *st, BOOL pause, const char *why)
+{
+    if (st->paused == pause)
+        return;
+    if (st->backend == BACKEND_WASAPI)
+    {
+        if (pause)
+            IAudioClient_Stop(st->audioClient);
+        else
+            IAudioClient_Start(st->audioClient);
+    }
+    else
+    {
+        if (pause)
+            waveOutPause(st->hwo);
+        else
+            waveOutRestart(st->hwo);
+    }
+    st->paused = pause;
+    dlog("[dev %d] %s\n", st->deviceIndex, why);
+}
+
+// --duty-cycle: pause streams whose endpoint is busy, resume them graceMs after it goes quiet.
+static void poll_activity(void)
+{
+    if (g_held)
+        return; // "pause" over the control pipe wins until "resume"
+    double now = now_ms();
+    for (int i = 0; i < g_numStreams; ++i)
+    {
+        AudioStream *st = &g_streams[i];
+        if (!st->active)
+            continue;
+        if (endpoint_busy(st))
+        {
+            st->quietSinceMs = 0;
+            stream_set_paused(st, TRUE, "other audio playing; pausing");
+        }
+        else if (st->paused)
+        {
+            if (st->quietSinceMs == 0)
+                st->quietSinceMs = now;
+            if (now - st->quietSinceMs >= g_config.graceMs)
+                stream_set_paused(st, FALSE, "endpoint quiet; resuming");
+        }
+    }
+}
+
+// Pages in the working set that no other process shares (Task Manager's "private working set").
+static SIZE_T private_working_set(void)
+{
+    DWORD cap = (DWORD)(sizeof(PSAPI_WORKING_SET_INFORMATION) + 4096 * sizeof(PSAPI_WORKING_SET_BLOCK));
+    for (int tries = 0; tries < 4; ++tries)
+    {
+        PSAPI_WORKING_SET_INFORMATION *ws = (PSAPI_WORKING_SET_INFORMATION *)HeapAlloc(GetProcessHeap(), 0, cap);
+        if (!ws)
+            return 0;
+        if (QueryWorkingSet(GetCurrentProcess(), ws, cap))
+        {
+            SYSTEM_INFO si;
+            SIZE_T pages = 0;
+            for (ULONG_PTR i = 0; i < ws->NumberOfEntries; ++i)
+                if (!ws->WorkingSetInfo[i].Shared)
+                    ++pages;
+            HeapFree(GetProcessHeap(), 0, ws);
+            GetSystemInfo(&si);
+            return pages * si.dwPageSize;
+        }
+        DWORD err = GetLastError();
+        ULONG_PTR need = ws->NumberOfEntries;
+        HeapFree(GetProcessHeap(), 0, ws);
+        if (err != ERROR_BAD_LENGTH)
+            return 0;
+        cap = (DWORD)(sizeof(PSAPI_WORKING_SET_INFORMATION) + (need + 256) * sizeof(PSAPI_WORKING_SET_BLOCK));
+    }
+    return 0;
+}
+static const char *memory_summary(char *text, size_t cap)
+{
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    ZeroMemory(&pmc, sizeof(pmc));
+    pmc.cb = sizeof(pmc);
+    GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&pmc, sizeof(pmc));
+    _snprintf(text, cap, "working set %lu KB, private working set %lu KB, commit %lu KB",
+              (unsigned long)(pmc.WorkingSetSize / 1024), (unsigned long)(private_working_set() / 1024),
+              (unsigned long)(pmc.PrivateUsage / 1024));
+    text[cap - 1] = '\0';
+    return text;
+}
+
+static void stats_open(void)
+{
+    wchar_t name[64];
+    _snwprintf(name, _countof(name), L"Local\\KeepAudio.Stats.%lu", (unsigned long)GetCurrentProcessId());
+    g_statsMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(KeepAudioStats), name);
+    if (!g_statsMapping)
+        return;
+    g_stats = (KeepAudioStats *)MapViewOfFile(g_statsMapping, FILE_MAP_WRITE, 0, 0, sizeof(KeepAudioStats));
+    if (!g_stats)
+    {
+        CloseHandle(g_statsMapping);
+        g_statsMapping = NULL;
+        return;
+    }
+    g_stats->magic = KA_STATS_MAGIC;
+    g_stats->version = KA_STATS_VERSION;
+    g_stats->size = sizeof(KeepAudioStats);
+    g_stats->pid = GetCurrentProcessId();
+}
+static void stats_close(void)
+{
+    if (g_stats)
+        UnmapViewOfFile(g_stats);
+    if (g_statsMapping)
+        CloseHandle(g_statsMapping);
+    g_stats = NULL;
+    g_statsMapping = NULL;
+}
+// Copy the stream counters into the shared block (worker thread, or main before it starts).
+static void stats_publish(void)
+{
+    if (!g_stats)
+        return;
+    InterlockedIncrement(&g_stats->seq);
+    g_stats->numStreams = g_numStreams;
+    g_stats->wakeups = g_wakeups;
+    g_stats->startupUs = g_startupUs;
+    for (int i = 0; i < g_numStreams; ++i)
+    {
+        const AudioStream *st = &g_streams[i];
+        KeepAudioStreamStats *o = &g_stats->streams[i];
+        o->deviceIndex = st->deviceIndex;
+        o->active = st->active;
+        o->paused = st->paused;
+        o->lost = st->lost;
+        o->reconnects = st->reconnects;
+        o->channels = st->channels;
+        o->framesWritten = st->framesQueued;
+        o->refills = st->refills;
+        o->lateRefills = st->lateRefills;
+        o->latencyTotalUs = st->latencyTotalUs;
+        o->latencyMaxUs = st->latencyMaxUs;
+        o->closeUs = st->closeUs;
+    }
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    ZeroMemory(&pmc, sizeof(pmc));
+    pmc.cb = sizeof(pmc);
+    if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&pmc, sizeof(pmc)))
+    {
+        g_stats->workingSetBytes = pmc.WorkingSetSize;
+        g_stats->privateBytes = pmc.PrivateUsage;
+    }
+    g_stats->updatedTick = GetTickCount64();
+    InterlockedIncrement(&g_stats->seq);
+}
+// Counter summary to the log, or appended to out (dump-stats over the control pipe).
+static void stats_log(char *out, size_t cap)
+{
+    char line[512];
+    size_t len = 0;
+    for (int i = 0; i <= g_numStreams; ++i)
+    {
+        if (i == g_numStreams)
+        {
+            char mem[128];
+            _snprintf(line, sizeof(line), "worker: %ld wakeups; startup %.1f ms; memory: %s\n", (long)g_wakeups,
+                      g_startupUs / 1000.0, memory_summary(mem, sizeof(mem)));
+        }
+        else
+        {
+            const AudioStream *st = &g_streams[i];
+            _snprintf(line, sizeof(line), "[dev %d] stats: %lld frames (%lld samples), %lld refills, %lld late, latency avg %.0f us max %lld us, "
+             "%ld reconnects, last close %.1f ms%s\n",
+                      st->deviceIndex, (long long)st->framesQueued, (long long)(st->framesQueued * st->channels),
+                      (long long)st->refills, (long long)st->lateRefills,
+                      st->refills ? (double)st->latencyTotalUs / (double)st->refills : 0.0, (long long)st->latencyMaxUs,
+                      (long)st->reconnects, st->closeUs / 1000.0, st->lost ? ", lost" : (st->paused ? ", paused" : ""));
+        }
+        line[sizeof(line) - 1] = '\0';
+        if (!out)
+        {
+            dlog("%s", line);
+            continue;
+        }
+        size_t n = strlen(line);
+        if (len + n < cap)
+        {
+            memcpy(out + len, line, n + 1);
+            len += n;
+        }
+    }
+}
+
+// avrt.dll is loaded on demand so the default run does not map it.
+typedef HANDLE(WINAPI *AvSetMmThreadCharacteristicsFn)(LPCWSTR, LPDWORD);
+typedef BOOL(WINAPI *AvRevertMmThreadCharacteristicsFn)(HANDLE);
+static HMODULE g_avrt = NULL;
+
+// --mmcss: join the "Audio" task so the scheduler boosts the worker while it is runnable.
+// Without the service (or on failure) a plain high priority still beats the build load.
+static HANDLE join_mmcss(void)
+{
+    DWORD taskIndex = 0;
+    HANDLE task = NULL;
+    g_avrt = LoadLibraryW(L"avrt.dll");
+    AvSetMmThreadCharacteristicsFn set =
+        g_avrt ? (AvSetMmThreadCharacteristicsFn)(void *)GetProcAddress(g_avrt, "AvSetMmThreadCharacteristicsW") : NULL;
+    if (set)
+        task = set(L"Audio", &taskIndex);
+    if (task)
+    {
+        dlog("Worker: MMCSS \"Audio\" task %lu\n", (unsigned long)taskIndex);
+        return task;
+    }
+    dlog("Worker: MMCSS unavailable (err=%lu); using THREAD_PRIORITY_TIME_CRITICAL\n", (unsigned long)GetLastError());
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+    return NULL;
+}
+
+static void leave_mmcss(HANDLE task)
+{
+    AvRevertMmThreadCharacteristicsFn revert =
+        g_avrt ? (AvRevertMmThreadCharacteristicsFn)(void *)GetProcAddress(g_avrt, "AvRevertMmThreadCharacteristics") : NULL;
+    if (task && revert)
+        revert(task);
+    if (g_avrt)
+    {
+        FreeLibrary(g_avrt);
+        g_avrt = NULL;
+    }
+}
+
+// Clear the run flag and wake everything that waits on it. The first caller's reason is the
+// one logged and traced.
+static void request_shutdown(const char *why)
+{
+    if (InterlockedExchange(&g_running, 0))
+    {
+        g_shutdownAtMs = now_ms();
+        dlog("Shutting down: %s\n", why);
+        KA_TRACE("Shutdown", WINEVENT_LEVEL_INFO, KA_KW_LIFECYCLE, TraceLoggingString(why, "Reason"));
+    }
+    if (g_shutdownEvent)
+        SetEvent(g_shutdownEvent);
+}
+
+// Audio worker thread: one wait across every stream's completion event plus shutdown.
+static DWORD WINAPI AudioThreadProc(LPVOID lp)
+{
+    BOOL comOk = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    HANDLE mmcssTask = g_config.mmcss ? join_mmcss() : NULL;
+    HANDLE handles[MAX_STREAMS + 2];
+    AudioStream *owners[MAX_STREAMS + 2];
+    const DWORD firstStream = 2; // [0] shutdown, [1] endpoint watcher
+    double lastPollMs = 0;
+    double lastPublishMs = 0;
+    double lastLogMs = now_ms();
+    double lastRetryMs = 0;
+    BOOL wasLost = FALSE;
+
+    // Prime and loop: streams are already primed by main before thread start.
+    while (InterlockedCompareExchange(&g_running, 1, 1))
+    {
+        DWORD n = 0;
+        BOOL anyLost = FALSE;
+        handles[n++] = g_shutdownEvent;
+        handles[n++] = g_deviceChangeEvent;
+        for (int i = 0; i < g_numStreams; ++i)
+        {
+            anyLost |= g_streams[i].lost;
+            if (!g_streams[i].active)
+                continue;
+            owners[n] = &g_streams[i];
+            handles[n++] = g_streams[i].event;
+        }
+        if (g_numStreams == 0)
+        {
+            dlog("No audio streams left running\n");
+            request_shutdown("no streams left");
+            break;
+        }
+        // The lost-stream retry keeps its own deadline, counted from the loss, so neither the
+        // activity poll nor busy streams change how often it runs.
+        if (anyLost && !wasLost)
+            lastRetryMs = now_ms();
+        wasLost = anyLost;
+        DWORD timeout = INFINITE;
+        if (anyLost)
+        {
+            double due = lastRetryMs + LOST_RETRY_MS - now_ms();
+            timeout = due > 0 ? (DWORD)due : 0;
+        }
+        if (g_config.dutyCycle)
+        {
+            // Paused streams raise no events, so the poll needs its own deadline.
+            double due = lastPollMs + ACTIVITY_POLL_MS - now_ms();
+            timeout = min(timeout, due > 0 ? (DWORD)due : 0);
+        }
+        DWORD w = WaitForMultipleObjects(n, handles, FALSE, timeout);
+        if (!InterlockedCompareExchange(&g_running, 1, 1) || w == WAIT_OBJECT_0 || w == WAIT_FAILED)
+            break;
+        InterlockedIncrement(&g_wakeups);
+        double nowMs = now_ms();
+        if (nowMs - lastPublishMs >= STATS_PUBLISH_MS)
+        {
+            stats_publish();
+            lastPublishMs = nowMs;
+        }
+        if (g_config.statsSeconds > 0 && nowMs - lastLogMs >= g_config.statsSeconds * 1000.0)
+        {
+            stats_log(NULL, 0);
+            lastLogMs = nowMs;
+        }
+        if (g_config.dutyCycle && now_ms() - lastPollMs >= ACTIVITY_POLL_MS)
+        {
+            poll_activity();
+            lastPollMs = now_ms();
+        }
+        BOOL retryDue = anyLost && nowMs - lastRetryMs >= LOST_RETRY_MS;
+        if (w == WAIT_OBJECT_0 + 1 || (w == WAIT_TIMEOUT && retryDue))
+        {
+            handle_device_events();
+            lastRetryMs = nowMs;
+            continue;
+        }
+        if (w == WAIT_TIMEOUT)
+            continue; // activity poll only
+        // The wait reports the lowest signalled index; sweep the rest so no stream starves.
+        DWORD first = w - WAIT_OBJECT_0;
+        for (DWORD k = first; k < n && k >= firstStream; ++k)
+        {
+            if (k != first && WaitForSingleObject(handles[k], 0) != WAIT_OBJECT_0)
+                continue;
+            if (!service_stream(owners[k]))
+            {
+                dlog("[dev %d] stream failed; waiting for the endpoint to come back\n", owners[k]->deviceIndex);
+                stream_lost(owners[k]);
+                reopen_stream(owners[k], "write failed");
+            }
+        }
+        // Streams that keep firing never let the wait time out; retry here once the deadline passes.
+        if (retryDue)
+        {
+            handle_device_events();
+            lastRetryMs = now_ms();
+        }
+    }
+    if (g_config.mmcss)
+        leave_mmcss(mmcssTask);
+    if (comOk)
+        CoUninitialize();
+    return 0;
+}
+
+// WM_POWERBROADCAST on the UI thread: record the state and let the worker act on it.
+static void handle_power_broadcast(WPARAM event, LPARAM data)
+{
+    switch (event)
+    {
+    case PBT_APMSUSPEND:
+        // Close the devices before the system sleeps; a handle carried across sleep often comes
+        // back broken.
+        InterlockedExchange(&g_systemSleeping, 1);
+        if (g_powerAck)
+            ResetEvent(g_powerAck);
+        signal_worker(DEVEV_POWER);
+        if (g_audioThread && g_powerAck)
+            WaitForSingleObject(g_powerAck, POWER_SUSPEND_WAIT_MS);
+        break;
+    case PBT_APMRESUMEAUTOMATIC: // always sent on resume; PBT_APMRESUMESUSPEND may follow
+        InterlockedExchange(&g_systemSleeping, 0);
+        signal_worker(DEVEV_POWER | DEVEV_RESUME);
+        break;
+    case PBT_POWERSETTINGCHANGE:
+    {
+        const POWERBROADCAST_SETTING *ps = (const POWERBROADCAST_SETTING *)data;
+        if (!ps || ps->DataLength < sizeof(DWORD))
+            break;
+        DWORD v = *(const DWORD *)ps->Data;
+        if (IsEqualGUID(&ps->PowerSetting, &KA_GUID_CONSOLE_DISPLAY_STATE))
+            InterlockedExchange(&g_displayOn, v != 0);
+        else if (IsEqualGUID(&ps->PowerSetting, &KA_GUID_ACDC_POWER_SOURCE))
+            InterlockedExchange(&g_onAc, v == 0);
+        else
+            break;
+        signal_worker(DEVEV_POWER);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Hidden top-level window to catch WM_ENDSESSION cleanly (message-only windows miss the broadcast)
+static LRESULT CALLBACK HiddenWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    switch (msg)
+    {
+    case WM_ENDSESSION:
+        if (wParam)
+            request_shutdown("session ending");
+        return 0;
+    case WM_POWERBROADCAST:
+        handle_power_broadcast(wParam, lParam);
+        return TRUE;
+    case WM_CLOSE:
+    case WM_QUIT:
+        request_shutdown("window closed");
+        return 0;
+    default:
+        return DefWindowProc(hwnd, msg, wParam, lParam);
+    }
+}
+
+static void parse_options(int argc, char **argv, Options *opt, BOOL *listOnly)
+{
+    BOOL buffersGiven = FALSE, channelsGiven = FALSE;
+    opt->freq = 1.0;
+    opt->db = -100.0;
+    opt->rate = 48000;
+    opt->rateMin = FALSE;
+    opt->devices[0] = -1;
+    opt->numDevices = 1;
+    opt->allDevices = FALSE;
+    opt->channels = 1;
+    opt->bufferFrames = 1024;
+    opt->numBuffers = 8;
+    opt->chance = 0;
+    opt->reqFmt = FMT_AUTO;
+    opt->synth = SYNTH_AUTO;
+    opt->intervalMs = 0;
+    opt->calibrate = FALSE;
+    opt->kernel = KERNEL_AUTO;
+    opt->staticBuffers = FALSE;
+    opt->lockMemory = FALSE;
+    opt->adaptive = FALSE;
+    opt->mmcss = FALSE;
+    opt->eco = FALSE;
+    opt->backend = BACKEND_WINMM;
+    opt->exclusive = FALSE;
+    opt->minPeriod = FALSE;
+    opt->dutyCycle = FALSE;
+    opt->graceMs = 2000;
+    opt->benchSeconds = 0;
+    opt->soakHours = 0.0;
+    opt->soakRebaseline = FALSE;
+    opt->soakBaseline[0] = L'\0';
+    opt->statsSeconds = 0;
+    opt->lean = FALSE;
+    opt->powerPolicy = POWER_ALWAYS;
+    opt->doInstall = FALSE;
+    opt->doInstallCopy = FALSE;
+    opt->doUninstall = FALSE;
+    opt->doInstallService = FALSE;
+    opt->doUninstallService = FALSE;
+    opt->service = FALSE;
+    opt->wantConsole = FALSE;
+    *listOnly = FALSE;
+    opt->deviceId[0] = L'\0';
+    opt->deviceName[0] = L'\0';
+    opt->json = FALSE;
+    opt->standalone = FALSE;
+    opt->control[0] = '\0';
+    opt->profiles[0] = L'\0';
+    wcsncpy(opt->startupName, L"KeepAudio", _countof(opt->startupName));
+    opt->startupName[_countof(opt->startupName) - 1] = L'\0';
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        if (!a)
+            continue;
+        if (str_eq_ci(a, "--console"))
+        {
+            opt->wantConsole = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--list-devices"))
+        {
+            *listOnly = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--help") || str_eq_ci(a, "-h") || str_eq_ci(a, "/?"))
+        {
+            *listOnly = TRUE;
+            continue;
+        } // show devices/usage via console/MB
+        if (str_eq_ci(a, "--install"))
+        {
+            opt->doInstall = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--install-copy"))
+        {
+            opt->doInstallCopy = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--uninstall"))
+        {
+            opt->doUninstall = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--install-service"))
+        {
+            opt->doInstallService = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--uninstall-service"))
+        {
+            opt->doUninstallService = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--service"))
+        {
+            opt->service = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--json"))
+        {
+            opt->json = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--standalone"))
+        {
+            opt->standalone = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--control"))
+        {
+            // CMD plus an optional value; "-90" is a value, "--x" the next flag.
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (!v)
+                continue;
+            const char *val = (i + 1 < argc && argv[i + 1] && strncmp(argv[i + 1], "--", 2) != 0) ? argv[++i] : NULL;
+            _snprintf(opt->control, sizeof(opt->control), val ? "%s %s" : "%s", v, val);
+            opt->control[sizeof(opt->control) - 1] = '\0';
+            continue;
+        }
+        if (str_eq_ci(a, "--device-id") || str_eq_ci(a, "--device-name"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            BOOL byId = str_eq_ci(a, "--device-id");
+            wchar_t *dst = byId ? opt->deviceId : opt->deviceName;
+            int cap = byId ? (int)_countof(opt->deviceId) : (int)_countof(opt->deviceName);
+            if (v)
+            {
+                int w = MultiByteToWideChar(CP_UTF8, 0, v, -1, dst, cap);
+                dst[w > 0 ? w - 1 : 0] = L'\0';
+            }
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--profiles"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            if (v)
+            {
+                int w = MultiByteToWideChar(CP_UTF8, 0, v, -1, opt->profiles, (int)_countof(opt->profiles));
+                opt->profiles[w > 0 ? w - 1 : 0] = L'\0';
+            }
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--startup-name"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            if (v)
+            {
+                int w = MultiByteToWideChar(CP_UTF8, 0, v, -1, opt->startupName, (int)_countof(opt->startupName));
+                if (w > 0)
+                    opt->startupName[w - 1] = L'\0';
+            }
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--freq"))
+        {
+            opt->freq = parse_double(next_arg_value(i, argc, argv), opt->freq);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--db"))
+        {
+            opt->db = parse_double(next_arg_value(i, argc, argv), opt->db);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--rate"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            if (v && str_eq_ci(v, "min"))
+                opt->rateMin = TRUE;
+            else
+                opt->rate = parse_int(v, opt->rate);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--device"))
+        {
+            // N, a comma-separated list (0,2,5), or "all"
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (!v)
+                continue;
+            if (str_eq_ci(v, "all"))
+            {
+                opt->allDevices = TRUE;
+                continue;
+            }
+            int n = 0;
+            const char *p = v;
+            while (*p && n < MAX_STREAMS)
+            {
+                char *end = NULL;
+                long d = strtol(p, &end, 10);
+                if (end == p)
+                    break;
+                opt->devices[n++] = (int)d;
+                if (*end != ',')
+                    break;
+                p = end + 1;
+            }
+            if (n > 0)
+            {
+                opt->numDevices = n;
+                opt->allDevices = FALSE;
+            }
+            continue;
+        }
+        if (str_eq_ci(a, "--channels"))
+        {
+            opt->channels = parse_int(next_arg_value(i, argc, argv), opt->channels);
+            ++i;
+            channelsGiven = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--frames"))
+        {
+            opt->bufferFrames = parse_int(next_arg_value(i, argc, argv), opt->bufferFrames);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--buffers"))
+        {
+            opt->numBuffers = parse_int(next_arg_value(i, argc, argv), opt->numBuffers);
+            buffersGiven = TRUE;
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--chance"))
+        {
+            opt->chance = parse_int(next_arg_value(i, argc, argv), opt->chance);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--format"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (v)
+            {
+                if (str_eq_ci(v, "auto"))
+                    opt->reqFmt = FMT_AUTO;
+                else if (str_eq_ci(v, "pcm16"))
+                    opt->reqFmt = FMT_PCM16;
+                else if (str_eq_ci(v, "float32"))
+                    opt->reqFmt = FMT_FLOAT32;
+            }
+            continue;
+        }
+        if (str_eq_ci(a, "--static"))
+        {
+            opt->staticBuffers = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--adaptive"))
+        {
+            opt->adaptive = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--mmcss"))
+        {
+            opt->mmcss = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--eco"))
+        {
+            opt->eco = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--lock-memory"))
+        {
+            opt->lockMemory = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--exclusive"))
+        {
+            opt->exclusive = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--min-period"))
+        {
+            opt->minPeriod = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--bench"))
+        {
+            // Optional value: --bench alone runs the loop for 10 s.
+            const char *v = next_arg_value(i, argc, argv);
+            opt->benchSeconds = 10;
+            if (v && v[0] != '-')
+            {
+                opt->benchSeconds = parse_int(v, opt->benchSeconds);
+                ++i;
+            }
+            opt->wantConsole = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--soak"))
+        {
+            // Optional value: --soak alone simulates one hour per case.
+            const char *v = next_arg_value(i, argc, argv);
+            opt->soakHours = 1.0;
+            if (v && v[0] != '-')
+            {
+                opt->soakHours = parse_double(v, opt->soakHours);
+                ++i;
+            }
+            opt->wantConsole = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--soak-rebaseline"))
+        {
+            // Implies --soak at its default length unless --soak gives one.
+            opt->soakRebaseline = TRUE;
+            if (opt->soakHours == 0.0)
+                opt->soakHours = 1.0;
+            opt->wantConsole = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--soak-baseline"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            if (v)
+            {
+                int w = MultiByteToWideChar(CP_UTF8, 0, v, -1, opt->soakBaseline, (int)_countof(opt->soakBaseline));
+                opt->soakBaseline[w > 0 ? w - 1 : 0] = L'\0';
+            }
+            if (opt->soakHours == 0.0)
+                opt->soakHours = 1.0;
+            opt->wantConsole = TRUE;
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--stats"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            opt->statsSeconds = 10;
+            if (v && v[0] != '-')
+            {
+                opt->statsSeconds = parse_int(v, opt->statsSeconds);
+                ++i;
+            }
+            continue;
+        }
+        if (str_eq_ci(a, "--power-policy"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (v)
+            {
+                if (str_eq_ci(v, "always"))
+                    opt->powerPolicy = POWER_ALWAYS;
+                else if (str_eq_ci(v, "ac"))
+                    opt->powerPolicy = POWER_AC;
+                else if (str_eq_ci(v, "display"))
+                    opt->powerPolicy = POWER_DISPLAY;
+                else if (str_eq_ci(v, "ac-or-display"))
+                    opt->powerPolicy = POWER_AC_OR_DISPLAY;
+            }
+            continue;
+        }
+        if (str_eq_ci(a, "--lean"))
+        {
+            opt->lean = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--duty-cycle"))
+        {
+            opt->dutyCycle = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--grace"))
+        {
+            opt->graceMs = parse_int(next_arg_value(i, argc, argv), opt->graceMs);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--backend"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (v)
+            {
+                if (str_eq_ci(v, "winmm"))
+                    opt->backend = BACKEND_WINMM;
+                else if (str_eq_ci(v, "wasapi"))
+                    opt->backend = BACKEND_WASAPI;
+            }
+            continue;
+        }
+        if (str_eq_ci(a, "--kernel"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (v)
+            {
+                if (str_eq_ci(v, "auto"))
+                    opt->kernel = KERNEL_AUTO;
+                else if (str_eq_ci(v, "scalar"))
+                    opt->kernel = KERNEL_SCALAR;
+                else if (str_eq_ci(v, "sse2"))
+                    opt->kernel = KERNEL_SSE2;
+                else if (str_eq_ci(v, "avx2"))
+                    opt->kernel = KERNEL_AVX2;
+            }
+            continue;
+        }
+        if (str_eq_ci(a, "--interval"))
+        {
+            opt->intervalMs = parse_int(next_arg_value(i, argc, argv), opt->intervalMs);
+            ++i;
+            continue;
+        }
+        if (str_eq_ci(a, "--calibrate"))
+        {
+            opt->calibrate = TRUE;
+            continue;
+        }
+        if (str_eq_ci(a, "--synth"))
+        {
+            const char *v = next_arg_value(i, argc, argv);
+            ++i;
+            if (v)
+            {
+                if (str_eq_ci(v, "auto"))
+                    opt->synth = SYNTH_AUTO;
+                else if (str_eq_ci(v, "lut"))
+                    opt->synth = SYNTH_LUT;
+                else if (str_eq_ci(v, "sine"))
+                    opt->synth = SYNTH_SINE;
+                else if (str_eq_ci(v, "pulse"))
+                    opt->synth = SYNTH_PULSE;
+            }
+            continue;
+        }
+    }
+    opt->freq = clamp_double(opt->freq, 0.1, 2000.0);
+    opt->db = clamp_double(opt->db, -150.0, -10.0);
+    if (opt->rate < 8000)
+        opt->rate = 8000;
+    if (opt->rate > 192000)
+        opt->rate = 192000;
+    if (opt->channels != 1 && opt->channels != 2)
+        opt->channels = 1;
+    if (opt->rateMin && !channelsGiven)
+        opt->channels = 1;
+    opt->bufferFrames = clamp_int(opt->bufferFrames, 128, 8192);
+    if (opt->eco && opt->mmcss)
+    {
+        dlog("--eco and --mmcss pull in opposite directions; ignoring --mmcss\n");
+        opt->mmcss = FALSE;
+    }
+    // A throttled process wakes late; more queued audio hides that unless --buffers was given.
+    if (opt->eco && !buffersGiven && opt->numBuffers < ECO_MIN_BUFFERS)
+        opt->numBuffers = ECO_MIN_BUFFERS;
+    opt->numBuffers = clamp_int(opt->numBuffers, 2, 32);
+    if (opt->chance != 0)
+        opt->chance = clamp_int(opt->chance, 1, 100);
+    if (opt->exclusive || opt->minPeriod)
+        opt->backend = BACKEND_WASAPI;
+    opt->graceMs = clamp_int(opt->graceMs, 0, 600000);
+    if (opt->benchSeconds != 0)
+        opt->benchSeconds = clamp_int(opt->benchSeconds, 1, 3600);
+    if (opt->soakHours != 0.0)
+        opt->soakHours = clamp_double(opt->soakHours, 0.01, 1000.0);
+    if (opt->intervalMs != 0)
+        opt->intervalMs = clamp_int(opt->intervalMs, PULSE_MIN_INTERVAL_MS, PULSE_MAX_INTERVAL_MS);
+    if (opt->calibrate)
+    {
+        // Calibration is interactive and always runs the pattern it measures.
+        opt->synth = SYNTH_PULSE;
+        opt->wantConsole = TRUE;
+    }
+    // Both measure this process's own streams; handing them to another instance defeats that.
+    if (opt->calibrate || opt->benchSeconds > 0)
+        opt->standalone = TRUE;
+    if (opt->statsSeconds != 0)
+        opt->statsSeconds = clamp_int(opt->statsSeconds, 1, 86400);
+    // An exclusive stream locks every other session out, so there is nothing to yield to.
+    if (opt->exclusive)
+        opt->dutyCycle = FALSE;
+}
+
+static void install_startup(int argc, char **argv, const Options *opt)
+{
+    wchar_t exePath[MAX_PATH] = {0};
+    if (!get_exe_path_w(exePath, _countof(exePath)))
+    {
+        dlog("Install: cannot get exe path\n");
+        return;
+    }
+
+    wchar_t useExe[MAX_PATH] = {0};
+    wcscpy(useExe, exePath);
+
+    if (opt->doInstallCopy)
+    {
+        wchar_t lad[MAX_PATH] = {0}, targetDir[MAX_PATH] = {0}, targetExe[MAX_PATH] = {0};
+        if (!get_localappdata_w(lad, _countof(lad)))
+        {
+            dlog("Install: cannot resolve LOCALAPPDATA\n");
+            return;
+        }
+        _snwprintf(targetDir, _countof(targetDir), L"%ls\\KeepAudio", lad);
+        if (!ensure_dir_exists_w(targetDir))
+        {
+            dlog("Install: cannot create dir\n");
+            return;
+        }
+        _snwprintf(targetExe, _countof(targetExe), L"%ls\\keepaudio.exe", targetDir);
+        if (!CopyFileW(exePath, targetExe, FALSE))
+        {
+            dlog("Install: copy failed (%lu)\n", GetLastError());
+            return;
+        }
+        wcsncpy(useExe, targetExe, _countof(useExe));
+        useExe[_countof(useExe) - 1] = L'\0';
+    }
+
+    wchar_t args[8192] = {0};
+    build_persisted_args_w(argc, argv, args, _countof(args));
+
+    wchar_t cmdline[9000] = {0};
+    build_cmdline_for_run_w(useExe, args, cmdline, _countof(cmdline));
+
+    if (reg_set_run_value_w(opt->startupName, cmdline))
+    {
+        dlog("Startup entry set: %ls\n", cmdline);
+    }
+    else
+    {
+        dlog("Install: failed to set Run value\n");
+    }
+}
+
+static void uninstall_startup(const Options *opt)
+{
+    if (reg_delete_run_value_w(opt->startupName))
+    {
+        dlog("Startup entry removed: %ls\n", opt->startupName);
+    }
+    else
+    {
+        dlog("Uninstall: entry not found or failed\n");
+    }
+    wchar_t lad[MAX_PATH] = {0}, targetDir[MAX_PATH] = {0}, targetExe[MAX_PATH] = {0};
+    if (get_localappdata_w(lad, _countof(lad)))
+    {
+        _snwprintf(targetDir, _countof(targetDir), L"%ls\\KeepAudio", lad);
+        _snwprintf(targetExe, _countof(targetExe), L"%ls\\KeepAudio\\keepaudio.exe", lad);
+        DeleteFileW(targetExe);
+        RemoveDirectoryW(targetDir);
+    }
+    RegDeleteKeyW(HKEY_CURRENT_USER, FMT_CACHE_KEY);
+    RegDeleteKeyW(HKEY_CURRENT_USER, PULSE_INTERVAL_KEY);
+    RegDeleteKeyW(HKEY_CURRENT_USER, SOAK_KEY);
+}
+
+// The default profiles directory, created (or re-secured) from the elevated --install-service
+// and never by an instance, so no user can own it and plant a file for everyone else.
+static void profiles_dir_secure(void)
+{
+    wchar_t dir[MAX_PATH];
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, FALSE};
+    ExpandEnvironmentStringsW(PROFILES_DEFAULT, dir, _countof(dir));
+    wchar_t *slash = wcsrchr(dir, L'\\');
+    if (slash)
+        *slash = L'\0';
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(PROFILES_DIR_SDDL, SDDL_REVISION_1, &sa.lpSecurityDescriptor,
+                                                              NULL))
+        return;
+    if (CreateDirectoryW(dir, &sa) ||
+        (GetLastError() == ERROR_ALREADY_EXISTS &&
+         SetFileSecurityW(dir, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, sa.lpSecurityDescriptor)))
+        dlog("Profiles directory %ls: writable by administrators only\n", dir);
+    else
+        dlog("Install service: cannot create or secure %ls (%lu)\n", dir, (unsigned long)GetLastError());
+    LocalFree(sa.lpSecurityDescriptor);
+}
+
+// --install-service: register (or re-point) an auto-start LocalService service that runs this
+// EXE in place with --service and the current flags, then start it. Needs an elevated prompt.
+static void install_service(int argc, char **argv, const Options *opt)
+{
+    wchar_t exePath[MAX_PATH] = {0};
+    if (!get_exe_path_w(exePath, _countof(exePath)))
+    {
+        dlog("Install service: cannot get exe path\n");
+        return;
+    }
+    wchar_t rest[8192] = {0}, args[8300] = {0};
+    build_persisted_args_w(argc, argv, rest, _countof(rest));
+    _snwprintf(args, _countof(args), rest[0] ? L"--service %ls" : L"--service", rest);
+    args[_countof(args) - 1] = L'\0';
+    wchar_t cmdline[9000] = {0};
+    build_cmdline_for_run_w(exePath, args, cmdline, _countof(cmdline));
+
+    SC_HANDLE scm = OpenSCManagerW(NULL, NULL, SC_MANAGER_CREATE_SERVICE);
+    if (!scm)
+    {
+        dlog("Install service: cannot open the service manager (%lu); run from an elevated prompt\n", GetLastError());
+        return;
+    }
+    // The audio service has to be up before the first open.
+    SC_HANDLE svc = CreateServiceW(scm, opt->startupName, L"KeepAudio", SERVICE_ALL_ACCESS, SERVICE_WIN32_OWN_PROCESS,
+                                   SERVICE_AUTO_START, SERVICE_ERROR_NORMAL, cmdline, NULL, NULL, L"AudioSrv\0",
+                                   L"NT AUTHORITY\\LocalService", L"");
+    if (!svc && GetLastError() == ERROR_SERVICE_EXISTS)
+    {
+        svc = OpenServiceW(scm, opt->startupName, SERVICE_ALL_ACCESS);
+        if (svc && !ChangeServiceConfigW(svc, SERVICE_NO_CHANGE, SERVICE_AUTO_START, SERVICE_NO_CHANGE, cmdline, NULL, NULL,
+                                         L"AudioSrv\0", NULL, NULL, NULL))
+            dlog("Install service: updating the command line failed (%lu)\n", GetLastError());
+    }
+    if (!svc)
+    {
+        dlog("Install service: failed (%lu)\n", GetLastError());
+        CloseServiceHandle(scm);
+        return;
+    }
+    if (!opt->profiles[0])
+        profiles_dir_secure();
+    SERVICE_DESCRIPTIONW desc = {L"Keeps audio outputs awake with a near-inaudible tone."};
+    ChangeServiceConfig2W(svc, SERVICE_CONFIG_DESCRIPTION, &desc);
+    // Restart on crashes and on a failed start (e.g. no endpoint yet at boot); reset daily.
+    SC_ACTION actions[3] = {{SC_ACTION_RESTART, SERVICE_RESTART_MS}, {SC_ACTION_RESTART, SERVICE_RESTART_MS},
+                            {SC_ACTION_RESTART, 6 * SERVICE_RESTART_MS}};
+    SERVICE_FAILURE_ACTIONSW fa = {86400, NULL, NULL, _countof(actions), actions};
+    SERVICE_FAILURE_ACTIONS_FLAG faf = {TRUE};
+    ChangeServiceConfig2W(svc, SERVICE_CONFIG_FAILURE_ACTIONS, &fa);
+    ChangeServiceConfig2W(svc, SERVICE_CONFIG_FAILURE_ACTIONS_FLAG, &faf);
+    if (StartServiceW(svc, 0, NULL) || GetLastError() == ERROR_SERVICE_ALREADY_RUNNING)
+        dlog("Service %ls installed and started: %ls\n", opt->startupName, cmdline);
+    else
+        dlog("Service %ls installed; start failed (%lu)\n", opt->startupName, GetLastError());
+    CloseServiceHandle(svc);
+    CloseServiceHandle(scm);
+}
+
+static void uninstall_service(const Options *opt)
+{
+    SC_HANDLE scm = OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    SC_HANDLE svc = scm ? OpenServiceW(scm, opt->startupName, SERVICE_STOP | SERVICE_QUERY_STATUS | DELETE) : NULL;
+    if (!svc)
+    {
+        dlog("Uninstall service: %ls not found or access denied (%lu)\n", opt->startupName, GetLastError());
+        if (scm)
+            CloseServiceHandle(scm);
+        return;
+    }
+    SERVICE_STATUS status;
+    ControlService(svc, SERVICE_CONTROL_STOP, &status);
+    if (DeleteService(svc))
+        dlog("Service %ls removed\n", opt->startupName);
+    else
+        dlog("Uninstall service: delete failed (%lu)\n", GetLastError());
+    CloseServiceHandle(svc);
+    CloseServiceHandle(scm);
+}
+
+// VirtualLock, growing the working-set minimum if the default quota is too small.
+static BOOL lock_region(void *p, SIZE_T bytes)
+{
+    SIZE_T minWs = 0, maxWs = 0;
+    if (VirtualLock(p, bytes))
+        return TRUE;
+    if (GetLastError() != ERROR_WORKING_SET_QUOTA ||
+        !GetProcessWorkingSetSize(GetCurrentProcess(), &minWs, &maxWs) ||
+        !SetProcessWorkingSetSize(GetCurrentProcess(), minWs + bytes, maxWs + bytes))
+        return FALSE;
+    return VirtualLock(p, bytes);
+}
+
+// One arena per winmm stream: WAVEHDRs and the buffer pointer array on the first page(s), then
+// the sample buffers from the next page boundary, cache-line strided. Headers stay writable
+// (the driver updates dwFlags); only the sample pages go read-only in static mode.
+static BOOL alloc_stream_arena(AudioStream *st, BOOL lock)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    SIZE_T page = si.dwPageSize;
+    SIZE_T stride = ((SIZE_T)st->bufBytes + 63) & ~(SIZE_T)63;
+    SIZE_T meta = (sizeof(WAVEHDR) + sizeof(void *)) * (SIZE_T)st->maxBuffers;
+    st->bufStride = stride;
+    st->arenaDataOffset = (meta + page - 1) & ~(page - 1);
+    st->arenaBytes = st->arenaDataOffset + ((stride * st->maxBuffers + page - 1) & ~(page - 1));
+    // --adaptive reserves room for maxBuffers but commits only the buffers in use.
+    SIZE_T committed = st->arenaDataOffset + ((stride * st->numBuffers + page - 1) & ~(page - 1));
+    st->arena = VirtualAlloc(NULL, st->arenaBytes, MEM_RESERVE, PAGE_READWRITE);
+    if (!st->arena)
+        return FALSE;
+    if (!VirtualAlloc(st->arena, committed, MEM_COMMIT, PAGE_READWRITE))
+        return FALSE;
+    st->headers = (WAVEHDR *)st->arena;
+    st->buffers = (void **)(st->headers + st->maxBuffers);
+    for (int i = 0; i < st->maxBuffers; ++i)
+        st->buffers[i] = (char *)st->arena + st->arenaDataOffset + (SIZE_T)i * stride;
+    if (lock)
+    {
+        if (lock_region(st->arena, committed))
+            dlog("[dev %d] buffer arena locked: %lu bytes\n", st->deviceIndex, (unsigned long)committed);
+        else
+            dlog("[dev %d] VirtualLock failed (%lu); arena stays pageable\n", st->deviceIndex, (unsigned long)GetLastError());
+    }
+    return TRUE;
+}
+
+// Whole pages used only by sample buffers [from, to) of the arena.
+static void arena_span(const AudioStream *st, int from, int to, char **start, SIZE_T *bytes)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    SIZE_T page = si.dwPageSize;
+    SIZE_T lo = st->arenaDataOffset + (SIZE_T)from * st->bufStride;
+    SIZE_T hi = st->arenaDataOffset + (((SIZE_T)to * st->bufStride + page - 1) & ~(page - 1));
+    lo = (lo + page - 1) & ~(page - 1); // a page shared with buffer from-1 stays committed
+    *start = (char *)st->arena + lo;
+    *bytes = hi > lo ? hi - lo : 0;
+}
+
+// --adaptive grow: commit and queue headers [numBuffers, count) behind the ones already
+// playing. The phase carries on from the last buffer written, so the stream does not glitch.
+static BOOL grow_queue(AudioStream *st, int count)
+{
+    char *first = (char *)st->buffers[st->numBuffers];
+    SIZE_T need = (SIZE_T)((char *)st->buffers[count - 1] + st->bufBytes - first);
+    if (!VirtualAlloc(first, need, MEM_COMMIT, PAGE_READWRITE))
+        return FALSE;
+    if (st->opt->lockMemory)
+        lock_region(first, need);
+    for (int i = st->numBuffers; i < count; ++i)
+    {
+        WAVEHDR *h = &st->headers[i];
+        ZeroMemory(h, sizeof(*h));
+        h->lpData = (LPSTR)st->buffers[i];
+        h->dwBufferLength = (DWORD)st->bufBytes;
+        h->dwUser = 1; // a page shared with a retired buffer may still hold its samples
+        fill_header(st, h);
+        if (waveOutPrepareHeader(st->hwo, h, sizeof(WAVEHDR)) != MMSYSERR_NOERROR)
+            return FALSE;
+        if (waveOutWrite(st->hwo, h, sizeof(WAVEHDR)) != MMSYSERR_NOERROR)
+        {
+            waveOutUnprepareHeader(st->hwo, h, sizeof(WAVEHDR));
+            h->dwFlags = 0;
+            return FALSE;
+        }
+        st->numBuffers = st->targetBuffers = i + 1;
+    }
+    return TRUE;
+}
+
+// --adaptive: track the least audio left queued at any wake (the refill slack), once per window
+// grow the queue when it ran low and shrink it one buffer at a time after a long calm spell.
+static void adapt_queue(AudioStream *st, int queued, double wakeMs)
+{
+    if (st->targetBuffers < st->numBuffers)
+    {
+        // Shrinking: once every retired header is back, give back their pages.
+        for (int i = st->targetBuffers; i < st->numBuffers; ++i)
+            if (st->headers[i].dwFlags & WHDR_PREPARED)
+                return;
+        char *start;
+        SIZE_T bytes;
+        arena_span(st, st->targetBuffers, st->numBuffers, &start, &bytes);
+        if (bytes)
+            VirtualFree(start, bytes, MEM_DECOMMIT);
+        st->numBuffers = st->targetBuffers;
+        st->windowStartMs = 0;
+        return;
+    }
+    if (st->windowStartMs == 0)
+    {
+        st->windowStartMs = wakeMs;
+        st->minQueued = queued;
+        st->windowLate = st->lateRefills;
+        return;
+    }
+    if (queued < st->minQueued)
+        st->minQueued = queued;
+    if (wakeMs - st->windowStartMs < ADAPT_WINDOW_MS)
+        return;
+    double bufMs = st->bufferFrames * 1000.0 / st->rate;
+    double slackMs = st->minQueued * bufMs;
+    BOOL late = st->lateRefills != st->windowLate;
+    st->windowStartMs = 0;
+    if ((late || slackMs < ADAPT_LOW_SLACK_MS) && st->numBuffers < st->maxBuffers)
+    {
+        int from = st->numBuffers;
+        int count = min(st->maxBuffers, from + max(2, from / 4));
+        st->calmWindows = 0;
+        if (grow_queue(st, count))
+            dlog("[dev %d] adaptive: %d -> %d buffers (slack %.1f ms%s)\n", st->deviceIndex, from, count, slackMs, late ? ", ran dry" : "");
+        else
+            dlog("[dev %d] adaptive: grow to %d buffers failed; staying at %d\n", st->deviceIndex, count, st->numBuffers);
+        return;
+    }
+    if ((st->minQueued - 1) * bufMs < ADAPT_HIGH_SLACK_MS || st->numBuffers <= ADAPT_MIN_BUFFERS)
+    {
+        st->calmWindows = 0;
+        return;
+    }
+    if (++st->calmWindows < ADAPT_CALM_WINDOWS)
+        return;
+    st->calmWindows = 0;
+    st->targetBuffers = st->numBuffers - 1;
+    dlog("[dev %d] adaptive: %d -> %d buffers (slack %.1f ms)\n", st->deviceIndex, st->numBuffers, st->targetBuffers, slackMs);
+}
+
+static void init_wfx(WAVEFORMATEX *wfx, SampleType type, int channels, int rate)
+{
+    ZeroMemory(wfx, sizeof(*wfx));
+    wfx->wFormatTag = (type == SAMPLE_F32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+    wfx->nChannels = (WORD)channels;
+    wfx->nSamplesPerSec = (DWORD)rate;
+    wfx->wBitsPerSample = (WORD)(sample_bytes(type) * 8);
+    wfx->nBlockAlign = (WORD)(wfx->nChannels * (wfx->wBitsPerSample / 8));
+    wfx->nAvgBytesPerSec = wfx->nSamplesPerSec * wfx->nBlockAlign;
+}
+
+// Cache identity of a waveOut device: the endpoint behind it (WAVE_MAPPER resolved to the
+// preferred device) and a fingerprint of its driver caps. No device is opened.
+static BOOL winmm_cache_identity(UINT deviceId, wchar_t *name, size_t cap, DWORD *caps)
+{
+    DWORD index = deviceId, flags = 0;
+    wchar_t id[256];
+    WAVEOUTCAPSW c;
+    if (deviceId == WAVE_MAPPER &&
+        waveOutMessage((HWAVEOUT)(UINT_PTR)WAVE_MAPPER, DRVM_MAPPER_PREFERRED_GET, (DWORD_PTR)&index, (DWORD_PTR)&flags) != MMSYSERR_NOERROR)
+        return FALSE;
+    if (!winmm_endpoint_id(index, id, _countof(id)) || waveOutGetDevCapsW(index, &c, sizeof(c)) != MMSYSERR_NOERROR)
+        return FALSE;
+    DWORD h = fnv1a(2166136261u, c.szPname, sizeof(c.szPname));
+    h = fnv1a(h, &c.wMid, sizeof(c.wMid));
+    h = fnv1a(h, &c.wPid, sizeof(c.wPid));
+    h = fnv1a(h, &c.vDriverVersion, sizeof(c.vDriverVersion));
+    h = fnv1a(h, &c.dwFormats, sizeof(c.dwFormats));
+    h = fnv1a(h, &c.wChannels, sizeof(c.wChannels));
+    *caps = fnv1a(h, &c.dwSupport, sizeof(c.dwSupport));
+    _snwprintf(name, cap, L"winmm|%ls", id);
+    name[cap - 1] = L'\0';
+    return TRUE;
+}
+
+// --rate min: lowest rate first, for paths where nothing resamples afterwards (WASAPI exclusive,
+// winmm without an endpoint). Lower rates mean less for us to synthesize.
+static const int kMinRates[] = {8000, 11025, 16000, 22050, 32000, 44100, 48000};
+
+// Shared-engine mix rate behind a waveOut device (or the mapper); 0 = no endpoint to ask.
+static int winmm_mix_rate(UINT deviceId)
+{
+    wchar_t id[256];
+    int rate = 0;
+    if (!(deviceId == WAVE_MAPPER ? winmm_default_endpoint_id(id, _countof(id)) : winmm_endpoint_id(deviceId, id, _countof(id))))
+        return 0;
+    BOOL comOk = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    IMMDevice *dev = mm_get_device_by_id(id);
+    IAudioClient *probe = NULL;
+    WAVEFORMATEX *mix = NULL;
+    if (dev && SUCCEEDED(IMMDevice_Activate(dev, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)) &&
+        SUCCEEDED(IAudioClient_GetMixFormat(probe, &mix)))
+    {
+        rate = (int)mix->nSamplesPerSec;
+        CoTaskMemFree(mix);
+    }
+    if (probe)
+        IAudioClient_Release(probe);
+    if (dev)
+        IMMDevice_Release(dev);
+    if (comOk)
+        CoUninitialize();
+    return rate;
+}
+
+// Rate --rate min opens the waveOut device (or the mapper) at for this layout; 0 = none. winmm
+// plays through the shared engine, which resamples anything else back to its mix rate, so
+// only the sample type and channels are narrowed there; the ascending probe is for devices
+// with no endpoint behind them.
+static int winmm_min_rate(UINT deviceId, SampleType type, int channels)
+{
+    WAVEFORMATEX wfx;
+    int mixRate = winmm_mix_rate(deviceId);
+    if (mixRate)
+    {
+        init_wfx(&wfx, type, channels, mixRate);
+        return waveOutOpen(NULL, deviceId, &wfx, 0, 0, WAVE_FORMAT_QUERY) == MMSYSERR_NOERROR ? mixRate : 0;
+    }
+    for (int r = 0; r < (int)_countof(kMinRates); ++r)
+    {
+        init_wfx(&wfx, type, channels, kMinRates[r]);
+        if (waveOutOpen(NULL, deviceId, &wfx, 0, 0, WAVE_FORMAT_QUERY) == MMSYSERR_NOERROR)
+            return kMinRates[r];
+    }
+    return 0;
+}
+
+static BOOL open_stream_winmm(AudioStream *st, const Options *opt)
+{
+    // Decide format; --rate min wants the narrowest sample too
+    AudioFormat useFmt = opt->reqFmt;
+    if (useFmt == FMT_AUTO)
+        useFmt = (opt->db <= -96.0 && !opt->rateMin) ? FMT_FLOAT32 : FMT_PCM16;
+
+    UINT deviceId = (st->deviceIndex < 0) ? WAVE_MAPPER : (UINT)st->deviceIndex;
+    WAVEFORMATEX wfx = {0};
+    MMRESULT mmr;
+
+    int rate = opt->rate;
+    st->channels = opt->channels;
+    st->phase = 0.0;
+    st->db = opt->db;
+    st->bufferFrames = opt->bufferFrames;
+
+    // Auto-reset event: winmm sets it once per completed header, the worker drains all WHDR_DONE headers per wakeup.
+    st->event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!st->event)
+        return FALSE;
+
+    // Candidates in preference order: explicit float32 may fall back to pcm16, explicit pcm16
+    // is final, auto tries the other one. WAVE_FORMAT_QUERY asks the driver without opening
+    // the device, so the real open runs once in the common case.
+    SampleType cand[2];
+    int numCand = 0;
+    cand[numCand++] = (useFmt == FMT_FLOAT32) ? SAMPLE_F32 : SAMPLE_S16;
+    if (useFmt == FMT_FLOAT32 || opt->reqFmt == FMT_AUTO)
+        cand[numCand++] = (useFmt == FMT_FLOAT32) ? SAMPLE_S16 : SAMPLE_F32;
+    wchar_t cacheName[300];
+    DWORD caps = 0, request = fmt_request_hash(opt);
+    FormatCacheEntry ce;
+    BOOL haveIdentity = winmm_cache_identity(deviceId, cacheName, _countof(cacheName), &caps);
+    BOOL cached = haveIdentity && fmt_cache_load(cacheName, request, caps, &ce) && (opt->rateMin || ce.rate == (DWORD)opt->rate) &&
+                  ce.channels == (DWORD)opt->channels && (ce.sample == (DWORD)cand[0] || (numCand == 2 && ce.sample == (DWORD)cand[1]));
+    if (cached)
+    {
+        // Known-good from a previous run: open it straight away, no query.
+        rate = (int)ce.rate;
+        if (ce.sample != (DWORD)cand[0])
+        {
+            cand[1] = cand[0];
+            cand[0] = (SampleType)ce.sample;
+        }
+    }
+    else if (opt->rateMin)
+    {
+        int r0 = winmm_min_rate(deviceId, cand[0], opt->channels);
+        int r1 = (numCand == 2 && r0 != kMinRates[0]) ? winmm_min_rate(deviceId, cand[1], opt->channels) : 0;
+        if (r1 && (!r0 || r1 < r0))
+        {
+            SampleType t = cand[0];
+            cand[0] = cand[1];
+            cand[1] = t;
+            r0 = r1;
+        }
+        if (r0)
+            rate = r0;
+    }
+    else if (numCand == 2)
+    {
+        init_wfx(&wfx, cand[0], opt->channels, opt->rate);
+        if (waveOutOpen(NULL, deviceId, &wfx, 0, 0, WAVE_FORMAT_QUERY) != MMSYSERR_NOERROR)
+        {
+            init_wfx(&wfx, cand[1], opt->channels, opt->rate);
+            if (waveOutOpen(NULL, deviceId, &wfx, 0, 0, WAVE_FORMAT_QUERY) == MMSYSERR_NOERROR)
+            {
+                SampleType t = cand[0];
+                cand[0] = cand[1];
+                cand[1] = t;
+            }
+        }
+    }
+    mmr = MMSYSERR_ERROR;
+    for (int c = 0; c < numCand && mmr != MMSYSERR_NOERROR; ++c)
+    {
+        init_wfx(&wfx, cand[c], opt->channels, rate);
+        mmr = waveOutOpen(&st->hwo, deviceId, &wfx, (DWORD_PTR)st->event, 0, CALLBACK_EVENT);
+        st->sample = cand[c];
+        if (mmr != MMSYSERR_NOERROR && cached && c == 0)
+        {
+            fmt_cache_drop(cacheName);
+            cached = FALSE;
+        }
+    }
+    if (mmr != MMSYSERR_NOERROR)
+        return FALSE;
+    st->rate = rate;
+    st->phaseStep = 2.0 * M_PI * opt->freq / (double)rate;
+    if (opt->rateMin)
+        dlog("winmm --rate min: %d Hz, %d ch, %s\n", rate, st->channels, sample_name(st->sample));
+    if (cached)
+    {
+        dlog("winmm: %s from the format cache\n", sample_name(st->sample));
+    }
+    else if (haveIdentity)
+    {
+        FormatCacheEntry e = {FMT_CACHE_VERSION, request, caps, (DWORD)st->sample, (DWORD)rate, (DWORD)opt->channels, 0, 0};
+        fmt_cache_store(cacheName, &e);
+    }
+
+    // Allocate buffers/headers and prime
+    st->numBuffers = opt->numBuffers;
+    st->staticBuffers = FALSE;
+    if (opt->staticBuffers)
+    {
+        int tileFrames = 0, tileBuffers = 0;
+        long long period = tone_period_frames(opt->freq, st->rate);
+        if (pick_static_tiling(period, st->bufferFrames, st->numBuffers, &tileFrames, &tileBuffers))
+        {
+            st->bufferFrames = tileFrames;
+            st->numBuffers = tileBuffers;
+            st->staticBuffers = TRUE;
+            dlog("Static buffers: %d x %d frames tile the %lld-frame period\n", st->numBuffers, st->bufferFrames, period);
+        }
+        else
+        {
+            dlog("Static buffers: no geometry tiles the tone period; refilling instead\n");
+        }
+    }
+    int bytesPerFrame = st->channels * sample_bytes(st->sample);
+    st->amp = sample_amplitude(st->sample, st->db);
+    st->bufBytes = st->bufferFrames * bytesPerFrame;
+    st->targetBuffers = st->numBuffers;
+    st->maxBuffers = (opt->adaptive && !st->staticBuffers) ? max(st->numBuffers, ADAPT_MAX_BUFFERS) : st->numBuffers;
+    st->windowStartMs = 0;
+    st->calmWindows = 0;
+
+    if (!alloc_stream_arena(st, opt->lockMemory))
+        return FALSE;
+
+    pulse_setup(st, opt);
+    if (st->pulse && st->staticBuffers)
+    {
+        dlog("Static buffers cannot carry the pulse pattern; refilling instead\n");
+        st->staticBuffers = FALSE;
+    }
+    if (!st->pulse && (opt->synth != SYNTH_SINE || st->staticBuffers))
+    {
+        if (build_tone_lut(st, opt->freq, st->rate))
+            dlog("Tone table: %d frames (%d bytes)\n", st->lutFrames, st->lutFrames * bytesPerFrame);
+        else if (opt->synth == SYNTH_LUT)
+            dlog("Tone table unavailable for %.4f Hz at %d Hz; synthesizing instead\n", opt->freq, st->rate);
+    }
+    if (st->staticBuffers && !st->lut)
+        st->staticBuffers = FALSE;
+
+    for (int i = 0; i < st->numBuffers; ++i)
+    {
+        st->headers[i].lpData = (LPSTR)st->buffers[i];
+        st->headers[i].dwBufferLength = (DWORD)st->bufBytes;
+        st->headers[i].dwUser = 0; // fresh arena pages are zero
+        fill_header(st, &st->headers[i]);
+
+        MMRESULT mmr2 = waveOutPrepareHeader(st->hwo, &st->headers[i], sizeof(WAVEHDR));
+        if (mmr2 != MMSYSERR_NOERROR)
+            return FALSE;
+        mmr2 = waveOutWrite(st->hwo, &st->headers[i], sizeof(WAVEHDR));
+        if (mmr2 != MMSYSERR_NOERROR)
+            return FALSE;
+    }
+    if (st->staticBuffers)
+    {
+        // The headers now hold the whole period; the table is no longer needed.
+        DWORD oldProt;
+        st->staticNext = 0;
+        HeapFree(GetProcessHeap(), 0, st->lut);
+        st->lut = NULL;
+        st->lutFrames = 0;
+        VirtualProtect((char *)st->arena + st->arenaDataOffset, st->arenaBytes - st->arenaDataOffset, PAGE_READONLY, &oldProt);
+    }
+    return TRUE;
+}
+
+// Fresh IAudioClient per attempt: a client whose Initialize failed cannot be retried.
+static HRESULT wasapi_try_init(AudioStream *st, AUDCLNT_SHAREMODE mode, const WAVEFORMATEX *wfx, DWORD flags, REFERENCE_TIME hnsBuffer,
+                               REFERENCE_TIME hnsPeriod, UINT32 *alignedFrames)
+{
+    if (st->audioClient)
+    {
+        IAudioClient_Release(st->audioClient);
+        st->audioClient = NULL;
+    }
+    HRESULT hr = IMMDevice_Activate(st->mmDevice, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&st->audioClient);
+    if (FAILED(hr))
+        return hr;
+    hr = IAudioClient_Initialize(st->audioClient, mode, AUDCLNT_STREAMFLAGS_EVENTCALLBACK | flags, hnsBuffer, hnsPeriod, wfx, NULL);
+    if (FAILED(hr))
+    {
+        // Exclusive mode: the failed client still reports the buffer size the driver can align to.
+        if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED && alignedFrames)
+            IAudioClient_GetBufferSize(st->audioClient, alignedFrames);
+        IAudioClient_Release(st->audioClient);
+        st->audioClient = NULL;
+    }
+    return hr;
+}
+
+// Formats we can render into directly: float32 or PCM 16/24/32-bit, plain or extensible.
+static BOOL wasapi_format_usable(const WAVEFORMATEX *wfx, SampleType *type)
+{
+    WORD tag = wfx->wFormatTag;
+    if (tag == WAVE_FORMAT_EXTENSIBLE && wfx->cbSize >= 22)
+    {
+        const WAVEFORMATEXTENSIBLE *ext = (const WAVEFORMATEXTENSIBLE *)wfx;
+        if (IsEqualGUID(&ext->SubFormat, &KA_KSDATAFORMAT_SUBTYPE_IEEE_FLOAT))
+            tag = WAVE_FORMAT_IEEE_FLOAT;
+        else if (IsEqualGUID(&ext->SubFormat, &KA_KSDATAFORMAT_SUBTYPE_PCM))
+            tag = WAVE_FORMAT_PCM;
+    }
+    if (tag == WAVE_FORMAT_IEEE_FLOAT && wfx->wBitsPerSample == 32)
+        *type = SAMPLE_F32;
+    else if (tag == WAVE_FORMAT_PCM && wfx->wBitsPerSample == 16)
+        *type = SAMPLE_S16;
+    else if (tag == WAVE_FORMAT_PCM && wfx->wBitsPerSample == 24)
+        *type = SAMPLE_S24;
+    else if (tag == WAVE_FORMAT_PCM && wfx->wBitsPerSample == 32)
+        *type = SAMPLE_S32; // full-scale 32-bit values are also right for 24-in-32
+    else
+        return FALSE;
+    return TRUE;
+}
+
+static void make_format_ext(WAVEFORMATEXTENSIBLE *x, SampleType type, int channels, int rate)
+{
+    ZeroMemory(x, sizeof(*x));
+    x->Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+    x->Format.nChannels = (WORD)channels;
+    x->Format.nSamplesPerSec = (DWORD)rate;
+    x->Format.wBitsPerSample = (WORD)(sample_bytes(type) * 8);
+    x->Format.nBlockAlign = (WORD)(channels * (x->Format.wBitsPerSample / 8));
+    x->Format.nAvgBytesPerSec = x->Format.nSamplesPerSec * x->Format.nBlockAlign;
+    x->Format.cbSize = 22;
+    x->Samples.wValidBitsPerSample = x->Format.wBitsPerSample;
+    x->dwChannelMask = (channels == 1) ? KSAUDIO_SPEAKER_MONO : (channels == 2) ? KSAUDIO_SPEAKER_STEREO : (DWORD)((1u << channels) - 1);
+    x->SubFormat = (type == SAMPLE_F32) ? KA_KSDATAFORMAT_SUBTYPE_IEEE_FLOAT : KA_KSDATAFORMAT_SUBTYPE_PCM;
+}
+
+// --rate min in shared mode. The engine mixes at the mix-format rate, so any other rate costs it
+// a resampler per stream: keep that rate and cut only the sample type and channel count, as far
+// as the engine takes them without conversion (the requested channels, else the mix's).
+static BOOL wasapi_shared_min_format(IAudioClient *client, const WAVEFORMATEX *mix, SampleType type, int channels,
+                                     WAVEFORMATEXTENSIBLE *out)
+{
+    const int tryChannels[2] = {channels, mix->nChannels};
+    for (int c = 0; c < 2; ++c)
+    {
+        WAVEFORMATEX *closest = NULL;
+        make_format_ext(out, type, tryChannels[c], (int)mix->nSamplesPerSec);
+        HRESULT hr = IAudioClient_IsFormatSupported(client, AUDCLNT_SHAREMODE_SHARED, &out->Format, &closest);
+        if (closest)
+            CoTaskMemFree(closest);
+        if (hr == S_OK)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// What --rate min opens in shared mode as pcm16 (rate and channels); 0 = only the mix format.
+static int wasapi_min_shared_rate(IMMDevice *dev, int *channels)
+{
+    IAudioClient *probe = NULL;
+    WAVEFORMATEX *mix = NULL;
+    int rate = 0;
+    if (FAILED(IMMDevice_Activate(dev, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)))
+        return 0;
+    if (SUCCEEDED(IAudioClient_GetMixFormat(probe, &mix)))
+    {
+        WAVEFORMATEXTENSIBLE x;
+        if (wasapi_shared_min_format(probe, mix, SAMPLE_S16, 1, &x))
+        {
+            rate = (int)x.Format.nSamplesPerSec;
+            *channels = x.Format.nChannels;
+        }
+        CoTaskMemFree(mix);
+    }
+    IAudioClient_Release(probe);
+    return rate;
+}
+
+// Lowest pcm16 rate the endpoint takes in exclusive mode at its mix channel count; 0 = none.
+static int wasapi_min_exclusive_rate(IMMDevice *dev, int *channels)
+{
+    IAudioClient *probe = NULL;
+    WAVEFORMATEX *mix = NULL;
+    int rate = 0;
+    if (FAILED(IMMDevice_Activate(dev, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)))
+        return 0;
+    if (SUCCEEDED(IAudioClient_GetMixFormat(probe, &mix)))
+    {
+        *channels = mix->nChannels;
+        for (int r = 0; r < (int)_countof(kMinRates) && !rate; ++r)
+        {
+            WAVEFORMATEXTENSIBLE x;
+            make_format_ext(&x, SAMPLE_S16, *channels, kMinRates[r]);
+            if (IAudioClient_IsFormatSupported(probe, AUDCLNT_SHAREMODE_EXCLUSIVE, &x.Format, NULL) == S_OK)
+                rate = kMinRates[r];
+        }
+        CoTaskMemFree(mix);
+    }
+    IAudioClient_Release(probe);
+    return rate;
+}
+
+static WAVEFORMATEX *wasapi_mix_format(AudioStream *st)
+{
+    WAVEFORMATEX *mix = NULL;
+    IAudioClient *probe = NULL;
+    if (SUCCEEDED(IMMDevice_Activate(st->mmDevice, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)))
+    {
+        IAudioClient_GetMixFormat(probe, &mix);
+        IAudioClient_Release(probe);
+    }
+    return mix;
+}
+
+static void wasapi_adopt_format(AudioStream *st, const WAVEFORMATEX *wfx, SampleType type)
+{
+    st->sample = type;
+    st->channels = wfx->nChannels;
+    st->rate = (int)wfx->nSamplesPerSec;
+}
+
+// Shared mode: requested format through the engine's converter first (--rate min: the mix rate
+// with fewer channels/bits, no converter), then the mix format as-is.
+static BOOL wasapi_init_shared(AudioStream *st, const Options *opt, AudioFormat useFmt)
+{
+    REFERENCE_TIME hnsBuffer;
+    HRESULT hr = E_FAIL;
+    WAVEFORMATEX *mix = wasapi_mix_format(st);
+    if (opt->rateMin)
+    {
+        IAudioClient *probe = NULL;
+        WAVEFORMATEXTENSIBLE low;
+        SampleType type = (useFmt == FMT_FLOAT32) ? SAMPLE_F32 : SAMPLE_S16;
+        BOOL found = FALSE;
+        if (mix && SUCCEEDED(IMMDevice_Activate(st->mmDevice, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)))
+        {
+            found = wasapi_shared_min_format(probe, mix, type, opt->channels, &low);
+            IAudioClient_Release(probe);
+        }
+        if (found)
+        {
+            hnsBuffer = (REFERENCE_TIME)(10000000.0 * opt->bufferFrames * opt->numBuffers / low.Format.nSamplesPerSec);
+            hr = wasapi_try_init(st, AUDCLNT_SHAREMODE_SHARED, &low.Format, 0, hnsBuffer, 0, NULL);
+            if (SUCCEEDED(hr))
+            {
+                wasapi_adopt_format(st, &low.Format, type);
+                CoTaskMemFree(mix);
+                return TRUE;
+            }
+        }
+    }
+    else
+    {
+        // Same queue depth the winmm path would hold; events still arrive once per engine period.
+        hnsBuffer = (REFERENCE_TIME)(10000000.0 * opt->bufferFrames * opt->numBuffers / opt->rate);
+        WAVEFORMATEX wfx = {0};
+        wfx.wFormatTag = (useFmt == FMT_FLOAT32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+        wfx.nChannels = (WORD)opt->channels;
+        wfx.nSamplesPerSec = (DWORD)opt->rate;
+        wfx.wBitsPerSample = (useFmt == FMT_FLOAT32) ? 32 : 16;
+        wfx.nBlockAlign = (WORD)(wfx.nChannels * (wfx.wBitsPerSample / 8));
+        wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+        hr = wasapi_try_init(st, AUDCLNT_SHAREMODE_SHARED, &wfx,
+                             AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY, hnsBuffer, 0, NULL);
+        if (SUCCEEDED(hr))
+        {
+            wasapi_adopt_format(st, &wfx, (useFmt == FMT_FLOAT32) ? SAMPLE_F32 : SAMPLE_S16);
+            if (mix)
+                CoTaskMemFree(mix);
+            return TRUE;
+        }
+    }
+    SampleType mixType = SAMPLE_F32;
+    if (!mix || !wasapi_format_usable(mix, &mixType))
+    {
+        dlog("WASAPI: cannot use requested or mix format (0x%08lx)\n", (unsigned long)hr);
+        if (mix)
+            CoTaskMemFree(mix);
+        return FALSE;
+    }
+    hnsBuffer = (REFERENCE_TIME)(10000000.0 * opt->bufferFrames * opt->numBuffers / mix->nSamplesPerSec);
+    hr = wasapi_try_init(st, AUDCLNT_SHAREMODE_SHARED, mix, 0, hnsBuffer, 0, NULL);
+    if (SUCCEEDED(hr))
+        wasapi_adopt_format(st, mix, mixType);
+    else
+        dlog("WASAPI Initialize failed: 0x%08lx\n", (unsigned long)hr);
+    CoTaskMemFree(mix);
+    return SUCCEEDED(hr);
+}
+
+// Shared mode at the engine's minimum period (IAudioClient3, Windows 10+). Mix format only.
+static BOOL wasapi_init_min_period(AudioStream *st)
+{
+#ifdef __IAudioClient3_INTERFACE_DEFINED__
+    IAudioClient3 *ac3 = NULL;
+    WAVEFORMATEX *mix = wasapi_mix_format(st);
+    SampleType mixType = SAMPLE_F32;
+    BOOL ok = FALSE;
+    if (!mix || !wasapi_format_usable(mix, &mixType))
+    {
+        if (mix)
+            CoTaskMemFree(mix);
+        return FALSE;
+    }
+    if (SUCCEEDED(IMMDevice_Activate(st->mmDevice, &KA_IID_IAudioClient3, CLSCTX_ALL, NULL, (void **)&ac3)))
+    {
+        UINT32 defFrames = 0, fundFrames = 0, minFrames = 0, maxFrames = 0;
+        HRESULT hr = IAudioClient3_GetSharedModeEnginePeriod(ac3, mix, &defFrames, &fundFrames, &minFrames, &maxFrames);
+        if (SUCCEEDED(hr))
+            hr = IAudioClient3_InitializeSharedAudioStream(ac3, AUDCLNT_STREAMFLAGS_EVENTCALLBACK, minFrames, mix, NULL);
+        if (SUCCEEDED(hr))
+            hr = IAudioClient3_QueryInterface(ac3, &KA_IID_IAudioClient, (void **)&st->audioClient);
+        if (SUCCEEDED(hr))
+        {
+            wasapi_adopt_format(st, mix, mixType);
+            dlog("WASAPI shared minimum period: %u frames (default %u)\n", (unsigned)minFrames, (unsigned)defFrames);
+            ok = TRUE;
+        }
+        else
+        {
+            dlog("WASAPI minimum-period stream failed: 0x%08lx\n", (unsigned long)hr);
+        }
+        IAudioClient3_Release(ac3);
+    }
+    CoTaskMemFree(mix);
+    return ok;
+#else
+    dlog("WASAPI minimum-period stream needs IAudioClient3 (built without it)\n");
+    return FALSE;
+#endif
+}
+
+// Exclusive mode bypasses the engine, so the stream must run in a format the hardware
+// accepts as-is. Candidates, best first: the device's own format (PKEY_AudioEngine_DeviceFormat),
+// then float32/PCM16 at the device rate and channel count, then at the requested rate.
+static BOOL wasapi_init_exclusive(AudioStream *st, const Options *opt, BOOL minPeriod)
+{
+    WAVEFORMATEXTENSIBLE cand[6 + _countof(kMinRates)];
+    SampleType candType[6 + _countof(kMinRates)];
+    int n = 0;
+    int devRate = opt->rate, devChannels = opt->channels;
+    BOOL haveNative = FALSE;
+
+    IPropertyStore *props = NULL;
+    if (SUCCEEDED(IMMDevice_OpenPropertyStore(st->mmDevice, STGM_READ, &props)))
+    {
+        PROPVARIANT pv;
+        PropVariantInit(&pv);
+        if (SUCCEEDED(IPropertyStore_GetValue(props, &KA_PKEY_AudioEngine_DeviceFormat, &pv)) && pv.vt == VT_BLOB &&
+            pv.blob.cbSize >= sizeof(WAVEFORMATEX))
+        {
+            const WAVEFORMATEX *dev = (const WAVEFORMATEX *)pv.blob.pBlobData;
+            devRate = (int)dev->nSamplesPerSec;
+            devChannels = dev->nChannels;
+            if (pv.blob.cbSize <= sizeof(cand[0]) && wasapi_format_usable(dev, &candType[n]))
+            {
+                ZeroMemory(&cand[n], sizeof(cand[n]));
+                memcpy(&cand[n], dev, pv.blob.cbSize);
+                ++n;
+                haveNative = TRUE;
+            }
+        }
+        PropVariantClear(&pv);
+        IPropertyStore_Release(props);
+    }
+    // The engine device format is what the user picks in the Sound control panel; the cache
+    // entry is void as soon as it changes.
+    wchar_t cacheName[300];
+    LPWSTR id = NULL;
+    BOOL haveIdentity = SUCCEEDED(IMMDevice_GetId(st->mmDevice, &id));
+    if (haveIdentity)
+    {
+        _snwprintf(cacheName, _countof(cacheName), L"wasapi-exclusive|%ls", id);
+        cacheName[_countof(cacheName) - 1] = L'\0';
+        CoTaskMemFree(id);
+    }
+    DWORD request = fmt_request_hash(opt);
+    DWORD caps = fnv1a(2166136261u, &devRate, sizeof(devRate));
+    caps = fnv1a(caps, &devChannels, sizeof(devChannels));
+    caps = haveNative ? fnv1a(caps, &cand[0], sizeof(cand[0])) : caps;
+    FormatCacheEntry ce;
+    if (haveIdentity && fmt_cache_load(cacheName, request, caps, &ce) && ce.sample <= SAMPLE_S32 && (!ce.native || haveNative))
+    {
+        // Skip the probe client, IsFormatSupported and the alignment retry: one Initialize.
+        WAVEFORMATEXTENSIBLE c;
+        SampleType type = ce.native ? candType[0] : (SampleType)ce.sample;
+        if (ce.native)
+            c = cand[0];
+        else
+            make_format_ext(&c, type, (int)ce.channels, (int)ce.rate);
+        if (SUCCEEDED(wasapi_try_init(st, AUDCLNT_SHAREMODE_EXCLUSIVE, &c.Format, 0, ce.period, ce.period, NULL)))
+        {
+            wasapi_adopt_format(st, &c.Format, type);
+            st->wasapiExclusive = TRUE;
+            dlog("WASAPI exclusive: period %.2f ms (format cache)\n", ce.period / 10000.0);
+            return TRUE;
+        }
+        fmt_cache_drop(cacheName);
+    }
+
+    // --rate min: the lowest pcm16 rates at the device channel count replace the device format.
+    if (opt->rateMin)
+    {
+        n = 0;
+        haveNative = FALSE;
+        for (int r = 0; r < (int)_countof(kMinRates) && kMinRates[r] < devRate; ++r)
+        {
+            candType[n] = SAMPLE_S16;
+            make_format_ext(&cand[n], SAMPLE_S16, devChannels, kMinRates[r]);
+            ++n;
+        }
+    }
+    const int rates[2] = {devRate, opt->rate};
+    for (int r = 0; r < 2; ++r)
+    {
+        if (r == 1 && opt->rate == devRate)
+            break;
+        for (int f = 0; f < 2; ++f)
+        {
+            candType[n] = (f == 0) ? SAMPLE_F32 : SAMPLE_S16;
+            make_format_ext(&cand[n], candType[n], devChannels, rates[r]);
+            ++n;
+        }
+    }
+
+    REFERENCE_TIME defPeriod = 0, minDevPeriod = 0;
+    IAudioClient *probe = NULL;
+    if (FAILED(IMMDevice_Activate(st->mmDevice, &KA_IID_IAudioClient, CLSCTX_ALL, NULL, (void **)&probe)))
+        return FALSE;
+    IAudioClient_GetDevicePeriod(probe, &defPeriod, &minDevPeriod);
+
+    for (int i = 0; i < n; ++i)
+    {
+        const WAVEFORMATEX *wfx = &cand[i].Format;
+        if (IAudioClient_IsFormatSupported(probe, AUDCLNT_SHAREMODE_EXCLUSIVE, wfx, NULL) != S_OK)
+            continue;
+        // Event-driven exclusive: buffer duration == periodicity.
+        REFERENCE_TIME period = minPeriod ? minDevPeriod : defPeriod;
+        UINT32 frames = 0;
+        HRESULT hr = wasapi_try_init(st, AUDCLNT_SHAREMODE_EXCLUSIVE, wfx, 0, period, period, &frames);
+        if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED && frames)
+        {
+            period = (REFERENCE_TIME)(10000000.0 * frames / wfx->nSamplesPerSec + 0.5);
+            hr = wasapi_try_init(st, AUDCLNT_SHAREMODE_EXCLUSIVE, wfx, 0, period, period, NULL);
+        }
+        if (SUCCEEDED(hr))
+        {
+            wasapi_adopt_format(st, wfx, candType[i]);
+            st->wasapiExclusive = TRUE;
+            dlog("WASAPI exclusive: period %.2f ms%s\n", period / 10000.0, (haveNative && i == 0) ? " (device format)" : "");
+            if (haveIdentity)
+            {
+                FormatCacheEntry e = {FMT_CACHE_VERSION, request, caps, (DWORD)candType[i], wfx->nSamplesPerSec, wfx->nChannels,
+                                      haveNative && i == 0, period};
+                fmt_cache_store(cacheName, &e);
+            }
+            IAudioClient_Release(probe);
+            return TRUE;
+        }
+        dlog("WASAPI exclusive %d Hz %d-bit rejected: 0x%08lx\n", (int)wfx->nSamplesPerSec, wfx->wBitsPerSample,
+             (unsigned long)hr);
+    }
+    IAudioClient_Release(probe);
+    return FALSE;
 }
 
-static void parse_options(int argc, char **argv, Options *opt, BOOL *listOnly)
+static BOOL open_stream_wasapi(AudioStream *st, const Options *opt)
 {
-    opt->freq = 1.0;
-    opt->db = -100.0;
-    opt->rate = 48000;
-    opt->deviceIndex = -1;
-    opt->channels = 1;
-    opt->bufferFrames = 1024;
-    opt->numBuffers = 8;
-    opt->chance = 0;
-    opt->reqFmt = FMT_AUTO;
-    opt->doInstall = FALSE;
-    opt->doInstallCopy = FALSE;
-    opt->doUninstall = FALSE;
-    opt->wantConsole = FALSE;
-    *listOnly = FALSE;
-    wcsncpy(opt->startupName, L"KeepAudio", _countof(opt->startupName));
-    opt->startupName[_countof(opt->startupName) - 1] = L'\0';
+    AudioFormat useFmt = opt->reqFmt;
+    if (useFmt == FMT_AUTO)
+        useFmt = (opt->db <= -96.0 && !opt->rateMin) ? FMT_FLOAT32 : FMT_PCM16;
 
-    for (int i = 1; i < argc; ++i)
+    HRESULT hr;
+    st->backend = BACKEND_WASAPI;
+    st->wasapiExclusive = FALSE;
+    st->db = opt->db;
+    st->phase = 0.0;
+    st->bufferFrames = opt->bufferFrames;
+    if (opt->staticBuffers)
+        dlog("Static buffers need the winmm backend; refilling instead\n");
+    if (opt->adaptive)
+        dlog("--adaptive resizes winmm queues only; the WASAPI buffer stays as initialized\n");
+
+    st->event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!st->event)
+        return FALSE;
+    st->mmDevice = (st->deviceIndex >= 0 && st->endpointId[0]) ? mm_get_device_by_id(st->endpointId)
+                                                                : mm_get_render_device(st->deviceIndex);
+    if (!st->mmDevice)
     {
-        const char *a = argv[i];
-        if (!a)
-            continue;
-        if (str_eq_ci(a, "--console"))
+        dlog("WASAPI: render endpoint %d not found\n", st->deviceIndex);
+        return FALSE;
+    }
+
+    BOOL ok = FALSE;
+    if (opt->exclusive)
+    {
+        ok = wasapi_init_exclusive(st, opt, opt->minPeriod);
+        if (!ok)
+            dlog("WASAPI exclusive mode unavailable; falling back to shared\n");
+    }
+    else if (opt->minPeriod)
+    {
+        ok = wasapi_init_min_period(st);
+        if (!ok)
+            dlog("WASAPI minimum period unavailable; using the default shared period\n");
+    }
+    if (!ok && !wasapi_init_shared(st, opt, useFmt))
+        return FALSE;
+    st->phaseStep = 2.0 * M_PI * opt->freq / (double)st->rate;
+
+    if (FAILED(IAudioClient_GetBufferSize(st->audioClient, &st->wasapiFrames)) ||
+        FAILED(IAudioClient_SetEventHandle(st->audioClient, st->event)) ||
+        FAILED(IAudioClient_GetService(st->audioClient, &KA_IID_IAudioRenderClient, (void **)&st->renderClient)))
+        return FALSE;
+
+    st->amp = sample_amplitude(st->sample, st->db);
+    pulse_setup(st, opt);
+    if (opt->synth != SYNTH_SINE && !st->pulse)
+    {
+        if (build_tone_lut(st, opt->freq, st->rate))
+            dlog("Tone table: %d frames\n", st->lutFrames);
+    }
+
+    // Prime the whole endpoint buffer, then start the stream.
+    if (!wasapi_refill(st, now_ms()))
+        return FALSE;
+    hr = IAudioClient_Start(st->audioClient);
+    if (FAILED(hr))
+    {
+        dlog("WASAPI Start failed: 0x%08lx\n", (unsigned long)hr);
+        return FALSE;
+    }
+    dlog("WASAPI %s: %d Hz, %d ch, %s, buffer %u frames\n", st->wasapiExclusive ? "exclusive" : "shared", st->rate, st->channels,
+         sample_name(st->sample), (unsigned)st->wasapiFrames);
+    return TRUE;
+}
+
+static void close_stream_wasapi(AudioStream *st)
+{
+    if (st->audioClient)
+        IAudioClient_Stop(st->audioClient);
+    if (st->renderClient)
+    {
+        IAudioRenderClient_Release(st->renderClient);
+        st->renderClient = NULL;
+    }
+    if (st->audioClient)
+    {
+        IAudioClient_Release(st->audioClient);
+        st->audioClient = NULL;
+    }
+    if (st->mmDevice)
+    {
+        IMMDevice_Release(st->mmDevice);
+        st->mmDevice = NULL;
+    }
+}
+
+// After waveOutReset every queued header comes back marked done, and each return signals the
+// CALLBACK_EVENT. Some drivers finish that just after the reset returns, so wait on the event
+// rather than polling, and give up after one buffer period instead of stalling session end.
+#define CLOSE_SLACK_MS 20 // on top of one buffer period
+static void winmm_drain(AudioStream *st)
+{
+    double deadline = now_ms() + st->bufferFrames * 1000.0 / st->rate + CLOSE_SLACK_MS;
+    for (;;)
+    {
+        int pending = 0;
+        for (int i = 0; st->headers && i < st->numBuffers; ++i)
         {
-            opt->wantConsole = TRUE;
-            continue;
+            if ((st->headers[i].dwFlags & WHDR_PREPARED) && !(st->headers[i].dwFlags & WHDR_DONE))
+                ++pending;
         }
-        if (str_eq_ci(a, "--list-devices"))
+        if (!pending)
+            return;
+        double left = deadline - now_ms();
+        if (left <= 0 || !st->event)
         {
-            *listOnly = TRUE;
-            continue;
+            dlog("[dev %d] close: %d buffer(s) not returned after reset\n", st->deviceIndex, pending);
+            return;
         }
-        if (str_eq_ci(a, "--help") || str_eq_ci(a, "-h") || str_eq_ci(a, "/?"))
+        WaitForSingleObject(st->event, (DWORD)ceil(left));
+    }
+}
+
+static void close_stream(AudioStream *st)
+{
+    BOOL wasOpen = st->hwo || st->audioClient;
+    double t0 = now_ms();
+    if (st->sessionMgr)
+    {
+        IAudioSessionManager2_Release(st->sessionMgr);
+        st->sessionMgr = NULL;
+    }
+    st->paused = FALSE;
+    st->quietSinceMs = 0;
+    if (st->backend == BACKEND_WASAPI)
+        close_stream_wasapi(st);
+    if (st->hwo)
+    {
+        waveOutReset(st->hwo);
+        winmm_drain(st);
+        for (int i = 0; st->headers && i < st->numBuffers; ++i)
+            waveOutUnprepareHeader(st->hwo, &st->headers[i], sizeof(WAVEHDR));
+        waveOutClose(st->hwo);
+        st->hwo = NULL;
+    }
+    if (st->arena)
+    {
+        // Locked pages are unlocked by the release.
+        VirtualFree(st->arena, 0, MEM_RELEASE);
+        st->arena = NULL;
+        st->arenaBytes = 0;
+        st->headers = NULL;
+        st->buffers = NULL;
+    }
+    if (st->event)
+    {
+        CloseHandle(st->event);
+        st->event = NULL;
+    }
+    if (st->lut)
+    {
+        HeapFree(GetProcessHeap(), 0, st->lut);
+        st->lut = NULL;
+        st->lutFrames = 0;
+    }
+    if (wasOpen)
+    {
+        st->closeUs = (LONGLONG)((now_ms() - t0) * 1000.0);
+        KA_TRACE("DeviceClose", WINEVENT_LEVEL_INFO, KA_KW_DEVICE, TraceLoggingInt32(st->deviceIndex, "Device"),
+                 TraceLoggingInt64(st->framesQueued, "Frames"), TraceLoggingInt64(st->lateRefills, "LateRefills"),
+                 TraceLoggingInt64(st->closeUs, "CloseUs"));
+    }
+}
+
+// Expand --device / --device-id / --device-name into device indexes. selected receives the
+// endpoint ID when one was named (it pins the stream to that endpoint). -1 = no such endpoint.
+static int resolve_devices(const Options *opt, int *list, wchar_t *selected, size_t cap)
+{
+    int count = 0;
+    selected[0] = L'\0';
+    if (opt->allDevices)
+    {
+        if (opt->backend == BACKEND_WASAPI)
         {
-            *listOnly = TRUE;
+            for (; count < MAX_STREAMS; ++count)
+            {
+                IMMDevice *dev = mm_get_render_device(count);
+                if (!dev)
+                    break;
+                IMMDevice_Release(dev);
+                list[count] = count;
+            }
+        }
+        else
+        {
+            UINT n = waveOutGetNumDevs();
+            for (UINT i = 0; i < n && count < MAX_STREAMS; ++i)
+                list[count++] = (int)i;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < opt->numDevices; ++i)
+            list[count++] = opt->devices[i];
+    }
+    // --device-id / --device-name: one stream bound to that endpoint, whatever its index now.
+    if (opt->deviceId[0] || opt->deviceName[0])
+    {
+        if (opt->deviceId[0])
+        {
+            wcsncpy(selected, opt->deviceId, cap);
+            selected[cap - 1] = L'\0';
+        }
+        else if (!mm_find_endpoint_by_name(opt->deviceName, selected, cap))
+        {
+            dlog("No active render endpoint matches --device-name \"%ls\"\n", opt->deviceName);
+            return -1;
+        }
+        int idx = (opt->backend == BACKEND_WASAPI) ? mm_index_for_endpoint(selected) : winmm_index_for_endpoint(selected);
+        if (idx < 0)
+        {
+            dlog("Endpoint %ls is not active\n", selected);
+            return -1;
+        }
+        list[0] = idx;
+        count = 1;
+    }
+    return count;
+}
+
+// Open one stream into the next g_streams slot. While the power policy has the streams closed
+// the slot is only filled in; apply_power_state opens it with the others.
+static BOOL add_stream(int index, const wchar_t *endpoint, const Options *opt)
+{
+    AudioStream *st = &g_streams[g_numStreams];
+    ZeroMemory(st, sizeof(*st));
+    st->deviceIndex = index;
+    st->backend = opt->backend;
+    st->opt = opt;
+    if (endpoint[0])
+        wcsncpy(st->endpointId, endpoint, _countof(st->endpointId) - 1);
+    if (g_streamsSuspended)
+    {
+        ++g_numStreams;
+        return TRUE;
+    }
+    BOOL ok = (st->backend == BACKEND_WASAPI) ? open_stream_wasapi(st, opt) : open_stream_winmm(st, opt);
+    if (!ok)
+    {
+        dlog("[dev %d] open failed; skipping\n", st->deviceIndex);
+        close_stream(st);
+        return FALSE;
+    }
+    record_endpoint_id(st);
+    trace_open(st, "start");
+    st->active = TRUE;
+    ++g_numStreams;
+    dlog("[dev %d] streaming %d Hz, %d ch, %s\n", st->deviceIndex, st->rate, st->channels, sample_name(st->sample));
+    if (g_held)
+        stream_set_paused(st, TRUE, "held by the control pipe");
+    return TRUE;
+}
+
+// Expand --device into streams and open each one. Devices that fail to open are skipped;
+// FALSE only when nothing could be opened.
+static BOOL open_streams(const Options *opt)
+{
+    int list[MAX_STREAMS];
+    wchar_t selected[256];
+    int count = resolve_devices(opt, list, selected, _countof(selected));
+    g_numStreams = 0;
+    for (int i = 0; i < count; ++i)
+        add_stream(list[i], selected, opt);
+    return g_numStreams > 0;
+}
+
+// TRUE when a stream already plays to the endpoint a request resolves to, by MMDevice endpoint
+// ID (winmm and WASAPI share them). Default-device requests resolve to the current default and
+// also match any default-device stream.
+static BOOL stream_running_on(AudioBackend backend, int index, const wchar_t *selected)
+{
+    wchar_t id[256];
+    id[0] = L'\0';
+    if (selected[0])
+    {
+        wcsncpy(id, selected, _countof(id) - 1);
+        id[_countof(id) - 1] = L'\0';
+    }
+    else if (backend == BACKEND_WASAPI)
+    {
+        IMMDevice *dev = mm_get_render_device(index);
+        LPWSTR p = NULL;
+        if (dev && SUCCEEDED(IMMDevice_GetId(dev, &p)))
+        {
+            wcsncpy(id, p, _countof(id) - 1);
+            id[_countof(id) - 1] = L'\0';
+            CoTaskMemFree(p);
+        }
+        if (dev)
+            IMMDevice_Release(dev);
+    }
+    else if (index >= 0)
+    {
+        winmm_endpoint_id((UINT)index, id, _countof(id));
+    }
+    else
+    {
+        winmm_default_endpoint_id(id, _countof(id));
+    }
+    for (int i = 0; i < g_numStreams; ++i)
+    {
+        const AudioStream *st = &g_streams[i];
+        if ((index < 0 && !selected[0] && st->deviceIndex < 0) || (id[0] && _wcsicmp(id, st->endpointId) == 0))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Worker side of DEVEV_JOIN: add the streams another instance asked for, skipping endpoints this
+// process already drives. Tone and format options come from the request; process-wide ones
+// (--mmcss, --duty-cycle, --power-policy, --stats, --lean) stay as this instance started.
+static void join_request(void)
+{
+    int list[MAX_STREAMS];
+    wchar_t selected[256];
+    int count = -1, added = 0, running = 0;
+    Options *opt = (g_numJoined < MAX_STREAMS) ? &g_joined[g_numJoined] : NULL;
+    if (opt)
+    {
+        *opt = g_joinRequest;
+        count = resolve_devices(opt, list, selected, _countof(selected));
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        if (stream_running_on(opt->backend, list[i], selected))
+            ++running;
+        else if (g_numStreams < MAX_STREAMS && add_stream(list[i], selected, opt))
+            ++added;
+    }
+    if (added)
+        ++g_numJoined;
+    if (count < 0)
+        _snwprintf(g_requestReply, _countof(g_requestReply), L"no such device (or no room for another request)");
+    else
+        _snwprintf(g_requestReply, _countof(g_requestReply), L"%d stream(s) added, %d already running; %d stream(s) in pid %lu",
+                   added, running, g_numStreams, (unsigned long)GetCurrentProcessId());
+    g_requestReply[_countof(g_requestReply) - 1] = L'\0';
+    dlog("Handover: %ls\n", g_requestReply);
+    InterlockedExchange(&g_requestBusy, 0);
+    if (g_requestAck)
+        SetEvent(g_requestAck);
+}
+
+// Phase of the next frame the stream will write, whichever path produces it.
+static double stream_phase(const AudioStream *st)
+{
+    double ph = st->phase;
+    if (st->staticBuffers)
+        ph += st->phaseStep * (double)st->staticNext * (double)st->bufferFrames;
+    else if (st->lut)
+        ph += 2.0 * M_PI * (double)(((long long)st->lutPos * st->lutCycles) % st->lutFrames) / (double)st->lutFrames;
+    return fmod(ph, 2.0 * M_PI);
+}
+
+// New level/frequency from the next refill on. The tone resumes at the phase the old one had
+// reached; buffers already queued play out unchanged. A static stream goes back to refilling
+// (its buffers hold the old period), re-using a table when it had one.
+static void stream_retune(AudioStream *st, double db, double freq)
+{
+    double phase = stream_phase(st);
+    BOOL table = st->lut || st->staticBuffers;
+    if (st->staticBuffers)
+    {
+        DWORD oldProt;
+        VirtualProtect((char *)st->arena + st->arenaDataOffset, st->arenaBytes - st->arenaDataOffset, PAGE_READWRITE, &oldProt);
+        st->staticBuffers = FALSE;
+        dlog("[dev %d] retuned; static buffers now refill\n", st->deviceIndex);
+    }
+    if (st->lut)
+    {
+        HeapFree(GetProcessHeap(), 0, st->lut);
+        st->lut = NULL;
+        st->lutFrames = 0;
+    }
+    st->db = db;
+    st->amp = sample_amplitude(st->sample, db);
+    st->phase = phase;
+    st->phaseStep = 2.0 * M_PI * freq / (double)st->rate;
+    if (table && !st->pulse && !build_tone_lut(st, freq, st->rate))
+        dlog("[dev %d] no tone table for %.4f Hz; synthesizing instead\n", st->deviceIndex, freq);
+}
+
+// Worker side of DEVEV_CONTROL. Level and frequency also go into every option set so a
+// stream reopened after hot-plug keeps them.
+static void control_request(void)
+{
+    char text[PIPE_MSG_CHARS];
+    double v = g_controlValue;
+    text[0] = '\0';
+    switch (g_controlOp)
+    {
+    case CTL_SET_LEVEL:
+    case CTL_SET_FREQUENCY:
+    {
+        BOOL level = (g_controlOp == CTL_SET_LEVEL);
+        v = level ? clamp_double(v, -150.0, -10.0) : clamp_double(v, 0.1, 2000.0);
+        *(level ? &g_config.db : &g_config.freq) = v;
+        for (int i = 0; i < g_numJoined; ++i)
+            *(level ? &g_joined[i].db : &g_joined[i].freq) = v;
+        for (int i = 0; i < g_numProfiles; ++i)
+            *(level ? &g_profiles[i].opt.db : &g_profiles[i].opt.freq) = v;
+        for (int i = 0; i < g_numStreams; ++i)
+            if (g_streams[i].profile[0])
+                *(level ? &g_profileOpts[i].db : &g_profileOpts[i].freq) = v;
+        for (int i = 0; i < g_numStreams; ++i)
+        {
+            AudioStream *st = &g_streams[i];
+            if (st->active)
+                stream_retune(st, level ? v : st->db, level ? st->opt->freq : v);
+        }
+        _snprintf(text, sizeof(text), level ? "level %.1f dBFS on %d stream(s)" : "frequency %.4f Hz on %d stream(s)", v,
+                  g_numStreams);
+        break;
+    }
+    case CTL_PAUSE:
+    case CTL_RESUME:
+        g_held = (g_controlOp == CTL_PAUSE);
+        for (int i = 0; i < g_numStreams; ++i)
+            if (g_streams[i].active)
+                stream_set_paused(&g_streams[i], g_held, g_held ? "held by the control pipe" : "resumed by the control pipe");
+        _snprintf(text, sizeof(text), "%s %d stream(s)", g_held ? "paused" : "resumed", g_numStreams);
+        break;
+    case CTL_DUMP_STATS:
+        stats_log(text, sizeof(text));
+        break;
+    }
+    text[sizeof(text) - 1] = '\0';
+    if (g_controlOp != CTL_DUMP_STATS)
+        dlog("Control: %s\n", text);
+    MultiByteToWideChar(CP_UTF8, 0, text, -1, g_requestReply, (int)_countof(g_requestReply));
+    g_requestReply[_countof(g_requestReply) - 1] = L'\0';
+    InterlockedExchange(&g_requestBusy, 0);
+    if (g_requestAck)
+        SetEvent(g_requestAck);
+}
+
+// Profiles, worker side. A profiled stream's options live in g_profileOpts at its g_streams slot.
+static const Profile *profile_find(const wchar_t *name)
+{
+    for (int i = 0; i < g_numProfiles; ++i)
+        if (_wcsicmp(g_profiles[i].name, name) == 0)
+            return &g_profiles[i];
+    return NULL;
+}
+static AudioStream *stream_for_profile(const wchar_t *name)
+{
+    for (int i = 0; i < g_numStreams; ++i)
+        if (_wcsicmp(g_streams[i].profile, name) == 0)
+            return &g_streams[i];
+    return NULL;
+}
+static AudioStream *stream_for_endpoint(const wchar_t *id)
+{
+    for (int i = 0; i < g_numStreams; ++i)
+        if (g_streams[i].endpointId[0] && _wcsicmp(g_streams[i].endpointId, id) == 0)
+            return &g_streams[i];
+    return NULL;
+}
+
+// Anything beyond level and frequency means a new device format or buffer layout.
+static BOOL options_need_reopen(const Options *a, const Options *b)
+{
+    return a->backend != b->backend || a->exclusive != b->exclusive || a->minPeriod != b->minPeriod ||
+           a->rate != b->rate || a->rateMin != b->rateMin || a->channels != b->channels ||
+           a->bufferFrames != b->bufferFrames || a->numBuffers != b->numBuffers || a->reqFmt != b->reqFmt ||
+           a->synth != b->synth || a->intervalMs != b->intervalMs || a->staticBuffers != b->staticBuffers ||
+           a->lockMemory != b->lockMemory || a->adaptive != b->adaptive;
+}
+
+// st->opt already points at the new options; old is what the stream was opened with. While the
+// power policy has the streams closed, apply_power_state opens them with st->opt later.
+static void stream_reconfigure(AudioStream *st, const Options *old, const char *why)
+{
+    if (options_need_reopen(old, st->opt))
+    {
+        st->backend = st->opt->backend;
+        if (!g_streamsSuspended)
+            reopen_stream(st, why);
+    }
+    else if (st->active && (old->db != st->opt->db || old->freq != st->opt->freq))
+    {
+        stream_retune(st, st->opt->db, st->opt->freq);
+        dlog("[dev %d] retuned (%s): %.1f dBFS, %.4f Hz\n", st->deviceIndex, why, st->db, st->opt->freq);
+    }
+}
+
+static void drop_stream(int i)
+{
+    close_stream(&g_streams[i]);
+    for (int k = i; k + 1 < g_numStreams; ++k)
+    {
+        g_streams[k] = g_streams[k + 1];
+        g_profileOpts[k] = g_profileOpts[k + 1];
+        if (g_streams[k].opt == &g_profileOpts[k + 1])
+            g_streams[k].opt = &g_profileOpts[k];
+    }
+    --g_numStreams;
+}
+
+// Bring the streams in line with g_profiles: a section that went away hands its stream back to
+// the command-line options (or closes it, if the section had opened it); a section already
+// governing a stream is re-applied; a new one takes over the stream on its endpoint or adds one.
+// Unchanged sections cost nothing, so this also runs on endpoint arrival for sections whose
+// device was missing.
+static void profiles_apply(void)
+{
+    for (int i = g_numStreams - 1; i >= 0; --i)
+    {
+        AudioStream *st = &g_streams[i];
+        if (!st->profile[0] || profile_find(st->profile))
             continue;
-        } // show devices/usage via console/MB
-        if (str_eq_ci(a, "--install"))
+        dlog("[dev %d] profile [%ls] removed\n", st->deviceIndex, st->profile);
+        st->profile[0] = L'\0';
+        if (!st->baseOpt)
         {
-            opt->doInstall = TRUE;
+            drop_stream(i);
             continue;
         }
-        if (str_eq_ci(a, "--install-copy"))
+        Options old = *st->opt;
+        st->opt = st->baseOpt;
+        st->baseOpt = NULL;
+        stream_reconfigure(st, &old, "profile removed");
+    }
+    for (int p = 0; p < g_numProfiles; ++p)
+    {
+        const Profile *pr = &g_profiles[p];
+        AudioStream *st = stream_for_profile(pr->name);
+        if (!st)
         {
-            opt->doInstallCopy = TRUE;
+            int list[MAX_STREAMS];
+            wchar_t selected[256];
+            if (resolve_devices(&pr->opt, list, selected, _countof(selected)) < 1)
+                continue; // not connected; tried again when endpoints change
+            st = stream_for_endpoint(selected);
+            if (st && st->profile[0])
+                continue; // another section already names this endpoint; the first one wins
+            if (!st)
+            {
+                if (g_numStreams >= MAX_STREAMS)
+                    continue;
+                g_profileOpts[g_numStreams] = pr->opt;
+                if (add_stream(list[0], selected, &g_profileOpts[g_numStreams]))
+                {
+                    AudioStream *added = &g_streams[g_numStreams - 1];
+                    wcsncpy(added->profile, pr->name, _countof(added->profile) - 1);
+                    dlog("[dev %d] profile [%ls] added the stream\n", added->deviceIndex, pr->name);
+                }
+                continue;
+            }
+            st->baseOpt = st->opt;
+            wcsncpy(st->profile, pr->name, _countof(st->profile) - 1);
+            dlog("[dev %d] profile [%ls] takes over the stream\n", st->deviceIndex, pr->name);
+        }
+        Options *slot = &g_profileOpts[st - g_streams];
+        Options old = *st->opt;
+        *slot = pr->opt;
+        st->opt = slot;
+        stream_reconfigure(st, &old, "profile");
+    }
+}
+
+// Worker side of DEVEV_PROFILES.
+static void profiles_request(void)
+{
+    memcpy(g_profiles, g_profileRequest, sizeof(Profile) * g_numProfileRequest);
+    g_numProfiles = g_numProfileRequest;
+    profiles_apply();
+    _snwprintf(g_requestReply, _countof(g_requestReply), L"%d section(s) applied; %d stream(s)", g_numProfiles,
+               g_numStreams);
+    g_requestReply[_countof(g_requestReply) - 1] = L'\0';
+    InterlockedExchange(&g_requestBusy, 0);
+    if (g_requestAck)
+        SetEvent(g_requestAck);
+}
+
+static void close_streams(void)
+{
+    // Reset every winmm device up front so their drains overlap instead of adding up.
+    for (int i = 0; i < g_numStreams; ++i)
+    {
+        if (g_streams[i].hwo)
+            waveOutReset(g_streams[i].hwo);
+    }
+    for (int i = 0; i < g_numStreams; ++i)
+        close_stream(&g_streams[i]);
+    g_numStreams = 0;
+}
+
+static int show_usage(BOOL console)
+{
+    const char *txt =
+        "KeepAudio (headless) - keep USB audio interface awake with a near-inaudible tone\n"
+        "Flags:\n"
+        "  --freq F_HZ  --db NEG_DBFS  --rate SR|min  --device N|N,M,...|all  --channels 1|2\n"
+        "  --frames N   --buffers K    --format auto|pcm16|float32  --synth auto|lut|sine|pulse\n"
+        "  --interval MS  --calibrate  --static  --lock-memory\n"
+        "  --adaptive  --mmcss  --eco\n"
+        "  --backend winmm|wasapi  --exclusive  --min-period  --duty-cycle [--grace MS]\n"
+        "  --power-policy always|ac|display|ac-or-display\n"
+        "  --kernel auto|scalar|sse2|avx2  --stats [SECONDS]  --bench [SECONDS]  --lean\n"
+        "  --soak [HOURS]  --soak-rebaseline  --soak-baseline FILE\n"
+        "  --chance P   --list-devices [--json]  --device-id ID  --device-name TEXT  --standalone\n"
+        "  --profiles PATH|none\n"
+        "  --control set-level DB|set-frequency HZ|pause|resume|dump-stats\n"
+        "  --install [--install-copy] [--startup-name Name]\n"
+        "  --uninstall  --install-service  --uninstall-service  --console\n";
+    if (console)
+        dlog("%s", txt);
+    else
+        MessageBoxA(NULL, txt, "KeepAudio - Help", MB_OK | MB_ICONINFORMATION);
+    return 0;
+}
+
+// --bench: kernels first (no device needed), then the real worker loop.
+#define BENCH_KERNEL_FRAMES (1 << 22) // frames rendered per kernel measurement
+
+static double filetime_ms(FILETIME ft)
+{
+    ULARGE_INTEGER u;
+    u.LowPart = ft.dwLowDateTime;
+    u.HighPart = ft.dwHighDateTime;
+    return (double)u.QuadPart / 10000.0;
+}
+static double process_cpu_ms(void)
+{
+    FILETIME c, e, k, u;
+    if (!GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u))
+        return 0.0;
+    return filetime_ms(k) + filetime_ms(u);
+}
+// Wall time since the process was created (includes loader and CRT startup).
+static double process_age_ms(void)
+{
+    FILETIME c, e, k, u, now;
+    if (!GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u))
+        return 0.0;
+    GetSystemTimeAsFileTime(&now);
+    return filetime_ms(now) - filetime_ms(c);
+}
+static double thread_cpu_ms(HANDLE h)
+{
+    FILETIME c, e, k, u;
+    if (!h || !GetThreadTimes(h, &c, &e, &k, &u))
+        return 0.0;
+    return filetime_ms(k) + filetime_ms(u);
+}
+
+// Max deviation of g_kernel from the scalar reference over one buffer: relative to the
+// amplitude for float32, in LSB for pcm16.
+static double bench_kernel_error(const AudioStream *st, void *buf, void *ref, int frames)
+{
+    double ph1 = 0.3, ph2 = 0.3, err = 0.0;
+    int n = frames * st->channels;
+    if (st->sample == SAMPLE_F32)
+    {
+        g_kernel->f32((float *)buf, frames, st->channels, &ph1, st->phaseStep, (float)st->amp);
+        fill_sine_f32((float *)ref, frames, st->channels, &ph2, st->phaseStep, (float)st->amp);
+        for (int i = 0; i < n; ++i)
+            err = fmax(err, fabs((double)((float *)buf)[i] - ((float *)ref)[i]) / st->amp);
+    }
+    else
+    {
+        g_kernel->i16((int16_t *)buf, frames, st->channels, &ph1, st->phaseStep, (int16_t)st->amp);
+        fill_sine_i16((int16_t *)ref, frames, st->channels, &ph2, st->phaseStep, (int16_t)st->amp);
+        for (int i = 0; i < n; ++i)
+            err = fmax(err, fabs((double)((int16_t *)buf)[i] - ((int16_t *)ref)[i]));
+    }
+    return err;
+}
+
+static void bench_kernels(const Options *opt)
+{
+    static const int frameSizes[] = {256, 1024, 4096};
+    const FillKernel *saved = g_kernel;
+    dlog("Fill kernels at %.3f Hz / %d Hz (maxerr vs scalar: fraction of amplitude for float32, LSB for pcm16):\n",
+         opt->freq, opt->rate);
+    dlog("  %-6s %-7s %2s %6s %9s %9s\n", "synth", "format", "ch", "frames", "ns/frame", "maxerr");
+    // Row 0 is the tone table; the rest are the synthesis kernels KERNEL_SCALAR..KERNEL_AVX2.
+    for (int k = 0; k <= KERNEL_AVX2; ++k)
+    {
+        BOOL useLut = (k == 0);
+        if (!useLut && !kernel_supported((FillKernelId)k))
             continue;
+        const char *name = useLut ? "lut" : g_kernels[k].name;
+        g_kernel = &g_kernels[useLut ? KERNEL_SCALAR : k];
+        for (int useFloat = 0; useFloat < 2; ++useFloat)
+        {
+            for (int ch = 1; ch <= 2; ++ch)
+            {
+                for (int f = 0; f < (int)_countof(frameSizes); ++f)
+                {
+                    int frames = frameSizes[f];
+                    AudioStream st;
+                    ZeroMemory(&st, sizeof(st));
+                    st.sample = useFloat ? SAMPLE_F32 : SAMPLE_S16;
+                    st.channels = ch;
+                    st.rate = opt->rate;
+                    st.db = opt->db;
+                    st.phaseStep = 2.0 * M_PI * opt->freq / (double)opt->rate;
+                    st.amp = sample_amplitude(st.sample, st.db);
+                    if (useLut && !build_tone_lut(&st, opt->freq, opt->rate))
+                    {
+                        dlog("  %-6s %-7s %2d %6d   (period does not fit a table)\n", name, sample_name(st.sample), ch, frames);
+                        continue;
+                    }
+                    void *buf = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)frames * ch * 4);
+                    void *ref = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)frames * ch * 4);
+                    if (buf && ref)
+                    {
+                        int reps = max(1, BENCH_KERNEL_FRAMES / frames);
+                        fill_frames(&st, buf, frames); // warm caches and the table
+                        double t0 = now_ms();
+                        for (int r = 0; r < reps; ++r)
+                            fill_frames(&st, buf, frames);
+                        double t1 = now_ms();
+                        char errText[16] = "-";
+                        if (!useLut)
+                            _snprintf(errText, sizeof(errText), "%.2g", bench_kernel_error(&st, buf, ref, frames));
+                        dlog("  %-6s %-7s %2d %6d %9.2f %9s\n", name, sample_name(st.sample), ch, frames,
+                             (t1 - t0) * 1e6 / ((double)reps * frames), errText);
+                    }
+                    if (buf)
+                        HeapFree(GetProcessHeap(), 0, buf);
+                    if (ref)
+                        HeapFree(GetProcessHeap(), 0, ref);
+                    if (st.lut)
+                        HeapFree(GetProcessHeap(), 0, st.lut);
+                }
+            }
         }
-        if (str_eq_ci(a, "--uninstall"))
+    }
+    g_kernel = saved;
+}
+
+static void bench_report(double wallMs, double processCpuMs, double workerCpuMs)
+{
+    LONGLONG frames = 0;
+    for (int i = 0; i < g_numStreams; ++i)
+        frames += g_streams[i].framesQueued;
+    double secs = wallMs / 1000.0;
+    dlog("Worker loop: %.1f s, %d stream(s), %lld frames, %.1f wakeups/s\n", secs, g_numStreams, (long long)frames,
+         g_wakeups / secs);
+    dlog("CPU: process %.1f ms (%.3f%%), worker %.1f ms", processCpuMs, processCpuMs * 100.0 / wallMs, workerCpuMs);
+    if (frames > 0)
+        dlog(", %.1f ns/frame (process CPU / frames)", processCpuMs * 1e6 / (double)frames);
+    dlog("\n");
+}
+
+// --soak: drive every fill path through hours of simulated playback into memory and compare it
+// with an ideal sine taken from the absolute frame index (exact in integer millihertz), so phase
+// drift, seams between buffers and throughput regressions show up without a device.
+#define SOAK_FULL_CHECK_EVERY 64              // every Nth buffer is compared sample by sample
+#define SOAK_MAX_ERR_S16 1.5                  // LSB: stores truncate, SIMD kernels work in float
+#define SOAK_MAX_ERR_F32 1e-4                 // fraction of the amplitude
+#define SOAK_MIN_SPEED 0.75                   // fail below this fraction of the recorded throughput
+#define SOAK_S16_DB -40.0                     // pcm16 at the default level is a 1 LSB square wave
+
+typedef struct
+{
+    double freq;
+    int rate;
+} SoakCase;
+
+typedef struct
+{
+    long long milliHz;
+    long long den; // rate * 1000
+    double amp;    // peak the path actually writes
+    double norm;   // error unit: amp for float32, 1 LSB for pcm16
+    double maxErr;
+    double seamErr;
+} SoakCheck;
+
+static double soak_frame_error(const AudioStream *st, const SoakCheck *c, const void *buf, int i, long long frame)
+{
+    double ideal = sin(2.0 * M_PI * (double)((frame * c->milliHz) % c->den) / (double)c->den) * c->amp;
+    double err = 0.0;
+    for (int ch = 0; ch < st->channels; ++ch)
+    {
+        int k = i * st->channels + ch;
+        double v = (st->sample == SAMPLE_F32) ? ((const float *)buf)[k] : ((const int16_t *)buf)[k];
+        err = fmax(err, fabs(v - ideal));
+    }
+    return err / c->norm;
+}
+
+// Fill `buffers` buffers back to back with nothing else in the loop; returns frames/s. One
+// timestamp pair for the whole run, so timer cost and resolution do not swamp a short fill.
+static double soak_time(AudioStream *st, void *buf, int bufFrames, long long buffers)
+{
+    double t0 = now_ms();
+    for (long long b = 0; b < buffers; ++b)
+        fill_frames(st, buf, bufFrames);
+    double ms = now_ms() - t0;
+    return ms > 0.0 ? (double)(buffers * bufFrames) * 1000.0 / ms : 0.0;
+}
+
+// Fill the same run again from the start and check it against the ideal sine.
+static void soak_check(AudioStream *st, SoakCheck *c, void *buf, int bufFrames, long long buffers)
+{
+    for (long long b = 0; b < buffers; ++b)
+    {
+        long long base = b * bufFrames;
+        fill_frames(st, buf, bufFrames);
+        if (b % SOAK_FULL_CHECK_EVERY == 0)
         {
-            opt->doUninstall = TRUE;
-            continue;
+            for (int i = 1; i < bufFrames - 1; ++i)
+                c->maxErr = fmax(c->maxErr, soak_frame_error(st, c, buf, i, base + i));
         }
-        if (str_eq_ci(a, "--startup-name"))
+        // First and last frame of every buffer: where a lost or repeated step would show.
+        c->seamErr = fmax(c->seamErr, soak_frame_error(st, c, buf, 0, base));
+        c->seamErr = fmax(c->seamErr, soak_frame_error(st, c, buf, bufFrames - 1, base + bufFrames - 1));
+    }
+}
+
+// Baselines live under SOAK_KEY, or in the [soak] section of the --soak-baseline file so a CI
+// runner with a fresh profile can be handed the figures for its hardware.
+static BOOL soak_baseline(const wchar_t *file, const wchar_t *name, DWORD *kfps)
+{
+    DWORD bytes = sizeof(*kfps);
+    if (file)
+    {
+        *kfps = GetPrivateProfileIntW(L"soak", name, 0, file);
+        return *kfps > 0;
+    }
+    return RegGetValueW(HKEY_CURRENT_USER, SOAK_KEY, name, RRF_RT_REG_DWORD, NULL, kfps, &bytes) == ERROR_SUCCESS;
+}
+static void soak_save_baseline(const wchar_t *file, const wchar_t *name, DWORD kfps)
+{
+    HKEY hKey;
+    if (file)
+    {
+        wchar_t v[16];
+        _snwprintf(v, _countof(v), L"%lu", (unsigned long)kfps);
+        v[_countof(v) - 1] = L'\0';
+        if (!WritePrivateProfileStringW(L"soak", name, v, file))
+            dlog("Soak: cannot write %ls (%lu)\n", file, (unsigned long)GetLastError());
+        return;
+    }
+    if (RegCreateKeyExW(HKEY_CURRENT_USER, SOAK_KEY, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL) != ERROR_SUCCESS)
+        return;
+    RegSetValueExW(hKey, name, 0, REG_DWORD, (const BYTE *)&kfps, sizeof(kfps));
+    RegCloseKey(hKey);
+}
+
+// Exit code: 0 = every path stayed within its error bound and its throughput baseline, 1 = a
+// path failed, 2 = none failed but some had no baseline to compare with (not a pass: CI with a
+// fresh profile would otherwise never check throughput).
+static int run_soak(const Options *opt)
+{
+    // Row 0 is the configured tone; the rest are rates and frequencies whose periods do not
+    // divide the buffer, plus one too long for a table.
+    const SoakCase cases[] = {{opt->freq, opt->rate}, {1.0, 44100}, {0.7, 48000}, {997.0, 44100}, {19.999, 96000}};
+    const FillKernel *saved = g_kernel;
+    int bufFrames = opt->bufferFrames, failures = 0, unchecked = 0;
+    double started = now_ms();
+    // The profile API resolves bare names against the Windows directory.
+    wchar_t fileBuf[MAX_PATH];
+    const wchar_t *file = NULL;
+    if (opt->soakBaseline[0] && GetFullPathNameW(opt->soakBaseline, _countof(fileBuf), fileBuf, NULL))
+        file = fileBuf;
+    void *buf = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)bufFrames * opt->channels * 4);
+    if (!buf)
+        return 1;
+    dlog("Soak: %.2f simulated hour(s) per case, %d-frame buffers, %d ch; float32 at %.0f dBFS, pcm16 at %.0f dBFS\n",
+         opt->soakHours, bufFrames, opt->channels, opt->db, SOAK_S16_DB);
+    dlog("  (maxerr/seam vs an ideal sine: fraction of amplitude for float32, LSB for pcm16)\n");
+    dlog("  %-6s %-7s %9s %6s %9s %9s %9s  %s\n", "synth", "format", "freq", "rate", "Mframe/s", "maxerr", "seam",
+         "verdict");
+    for (int n = 0; n < (int)_countof(cases); ++n)
+    {
+        SoakCheck proto;
+        ZeroMemory(&proto, sizeof(proto));
+        proto.milliHz = llround(cases[n].freq * 1000.0);
+        proto.den = (long long)cases[n].rate * 1000;
+        double freq = (double)proto.milliHz / 1000.0;
+        long long total = llround(opt->soakHours * 3600.0 * cases[n].rate);
+        long long buffers = (total + bufFrames - 1) / bufFrames;
+        for (int k = 0; k <= KERNEL_AVX2; ++k)
         {
-            const char *v = next_arg_value(i, argc, argv);
-            if (v)
+            BOOL useLut = (k == 0);
+            if (!useLut && !kernel_supported((FillKernelId)k))
+                continue;
+            const char *name = useLut ? "lut" : g_kernels[k].name;
+            g_kernel = &g_kernels[useLut ? KERNEL_SCALAR : k];
+            for (int useFloat = 0; useFloat < 2; ++useFloat)
             {
-                int w = MultiByteToWideChar(CP_UTF8, 0, v, -1, opt->startupName, (int)_countof(opt->startupName));
-                if (w > 0)
-                    opt->startupName[w - 1] = L'\0';
+                AudioStream st;
+                ZeroMemory(&st, sizeof(st));
+                st.sample = useFloat ? SAMPLE_F32 : SAMPLE_S16;
+                st.channels = opt->channels;
+                st.rate = cases[n].rate;
+                st.db = useFloat ? opt->db : SOAK_S16_DB;
+                st.phaseStep = 2.0 * M_PI * freq / (double)st.rate;
+                st.amp = sample_amplitude(st.sample, st.db);
+                if (useLut && !build_tone_lut(&st, freq, st.rate))
+                {
+                    dlog("  %-6s %-7s %9.3f %6d   (period does not fit a table)\n", name, sample_name(st.sample), freq,
+                         st.rate);
+                    continue;
+                }
+                SoakCheck c = proto;
+                c.amp = useFloat ? st.amp : (double)(int16_t)st.amp;
+                c.norm = useFloat ? st.amp : 1.0;
+                // The table is only read, so a copy of the fresh stream restarts the tone at frame 0.
+                AudioStream fresh = st;
+                double fps = soak_time(&st, buf, bufFrames, buffers);
+                st = fresh;
+                soak_check(&st, &c, buf, bufFrames, buffers);
+                if (st.lut)
+                    HeapFree(GetProcessHeap(), 0, st.lut);
+
+                double limit = useFloat ? SOAK_MAX_ERR_F32 : SOAK_MAX_ERR_S16;
+                wchar_t key[64];
+                _snwprintf(key, _countof(key), L"%hs-%hs-%lldmHz-%d-%dch-%d", name, sample_name(st.sample),
+                           proto.milliHz, st.rate, st.channels, bufFrames);
+                key[_countof(key) - 1] = 0;
+                char verdict[48] = "ok";
+                DWORD base = 0, kfps = (DWORD)min(fps / 1000.0, 4e9);
+                if (fmax(c.maxErr, c.seamErr) > limit)
+                    _snprintf(verdict, sizeof(verdict), "FAIL (error > %.2g)", limit);
+                else if (opt->soakRebaseline)
+                {
+                    if (soak_baseline(file, key, &base) && base > 0)
+                        _snprintf(verdict, sizeof(verdict), "ok (rebaselined, %.0f%% of old)", kfps * 100.0 / base);
+                    else
+                        strcpy(verdict, "ok (new baseline)");
+                    soak_save_baseline(file, key, kfps);
+                }
+                else if (!soak_baseline(file, key, &base) || base == 0)
+                    strcpy(verdict, "NO BASELINE");
+                else if (kfps < base * SOAK_MIN_SPEED)
+                    _snprintf(verdict, sizeof(verdict), "FAIL (%.0f%% of baseline)", kfps * 100.0 / base);
+                verdict[sizeof(verdict) - 1] = 0;
+                if (verdict[0] == 'F')
+                    ++failures;
+                else if (verdict[0] == 'N')
+                    ++unchecked;
+                dlog("  %-6s %-7s %9.3f %6d %9.1f %9.2g %9.2g  %s\n", name, sample_name(st.sample), freq, st.rate,
+                     fps / 1e6, c.maxErr, c.seamErr, verdict);
             }
-            ++i;
-            continue;
         }
-        if (str_eq_ci(a, "--freq"))
-        {
-            opt->freq = parse_double(next_arg_value(i, argc, argv), opt->freq);
-            ++i;
+    }
+    g_kernel = saved;
+    HeapFree(GetProcessHeap(), 0, buf);
+    dlog("Soak: %s, %d failure(s), %d path(s) without a baseline in %.1f s\n",
+         failures ? "FAIL" : unchecked ? "INCOMPLETE" : "PASS", failures, unchecked, (now_ms() - started) / 1000.0);
+    if (unchecked && !failures)
+        dlog("Soak: record baselines with --soak-rebaseline (or pass them with --soak-baseline FILE)\n");
+    return failures ? 1 : unchecked ? 2 : 0;
+}
+
+// SetProcessInformation is Windows 8+; resolve it at runtime so the exe still starts on 7.
+typedef BOOL(WINAPI *SetProcessInformationFn)(HANDLE, int, LPVOID, DWORD);
+#define KA_PROCESS_MEMORY_PRIORITY 0 // PROCESS_INFORMATION_CLASS ProcessMemoryPriority
+#define KA_MEMORY_PRIORITY_LOW 2
+#define KA_PROCESS_POWER_THROTTLING 4 // ProcessPowerThrottling (Windows 10 1709+)
+#define KA_POWER_THROTTLING_EXECUTION_SPEED 1
+static BOOL set_process_information(int infoClass, void *info, DWORD size)
+{
+    SetProcessInformationFn fn =
+        (SetProcessInformationFn)(void *)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetProcessInformation");
+    return fn && fn(GetCurrentProcess(), infoClass, info, size);
+}
+
+typedef struct
+{
+    ULONG Version; // PROCESS_POWER_THROTTLING_CURRENT_VERSION (1)
+    ULONG ControlMask;
+    ULONG StateMask;
+} KaPowerThrottlingState;
+
+// --eco: opt the whole process into EcoQoS. On hybrid CPUs the scheduler then prefers the
+// efficiency cores and a lower clock; elsewhere it is just a power hint.
+static void enable_eco_qos(void)
+{
+    KaPowerThrottlingState ts = {1, KA_POWER_THROTTLING_EXECUTION_SPEED, KA_POWER_THROTTLING_EXECUTION_SPEED};
+    if (set_process_information(KA_PROCESS_POWER_THROTTLING, &ts, sizeof(ts)))
+        dlog("Eco: EcoQoS enabled, %d buffers queued\n", g_config.numBuffers);
+    else
+        dlog("Eco: power throttling not available (err=%lu)\n", (unsigned long)GetLastError());
+}
+
+#define LEAN_TRIM_DELAY_MS 2000 // let the first refills settle before trimming
+
+// --lean: give back what setup touched. The worker's few pages fault straight back in; argv,
+// console/registry/install paths and COM setup stay out. Low memory priority makes the rest
+// of our pages the first to be repurposed once they are on the standby list.
+static void lean_trim(void)
+{
+    ULONG prio = KA_MEMORY_PRIORITY_LOW;
+    if (!set_process_information(KA_PROCESS_MEMORY_PRIORITY, &prio, sizeof(prio)))
+        dlog("Lean: memory priority not available\n");
+    HeapCompact(GetProcessHeap(), 0);
+    EmptyWorkingSet(GetCurrentProcess());
+    char mem[128];
+    dlog("Lean: %s\n", memory_summary(mem, sizeof(mem)));
+}
+
+#define CAL_MAX_MS 120000     // stop doubling here (longer gates are as good as none)
+#define CAL_SETTLE_MS 2000    // extra watch time per step on top of two full intervals
+#define CAL_RESOLUTION_MS 250 // bisect until the bracket is this narrow (or 1/8 of the result)
+
+// --calibrate: one verdict from the console. 1 = stayed awake (no key before holdMs ran out),
+// 0 = the user saw it drop out (N), -1 = quit (Q/Esc, shutdown, console gone).
+static int calibrate_wait(HANDLE in, DWORD holdMs)
+{
+    HANDLE h[2] = {g_shutdownEvent, in};
+    double end = now_ms() + holdMs;
+    FlushConsoleInputBuffer(in);
+    for (;;)
+    {
+        double left = end - now_ms();
+        if (left <= 0)
+            return 1;
+        DWORD w = WaitForMultipleObjects(2, h, FALSE, (DWORD)ceil(left));
+        if (w == WAIT_TIMEOUT)
+            return 1;
+        if (w != WAIT_OBJECT_0 + 1)
+            return -1;
+        INPUT_RECORD rec;
+        DWORD got = 0;
+        if (!ReadConsoleInputW(in, &rec, 1, &got))
+            return -1;
+        if (got == 0 || rec.EventType != KEY_EVENT || !rec.Event.KeyEvent.bKeyDown)
             continue;
-        }
-        if (str_eq_ci(a, "--db"))
+        WCHAR ch = rec.Event.KeyEvent.uChar.UnicodeChar;
+        if (ch == L'n' || ch == L'N')
+            return 0;
+        if (ch == L'q' || ch == L'Q' || ch == 27)
+            return -1;
+    }
+}
+
+// --calibrate: only the user can see an external amplifier's gate close, so ask. Double the
+// pulse interval until the device drops out, bisect the bracket, then store 3/4 of the longest
+// interval that held for each open stream's endpoint; pulse mode picks it up from then on.
+static void run_calibration(const Options *opt)
+{
+    HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+    if (!in || in == INVALID_HANDLE_VALUE)
+    {
+        dlog("Calibrate: no console input\n");
+        return;
+    }
+    dlog("Calibrate: watch the device's power LED or listen for its standby click.\n"
+         "Press N as soon as it drops out, Q to stop. A step passes if nothing is pressed.\n");
+    DWORD good = 0, bad = 0;
+    DWORD iv = opt->intervalMs > 0 ? (DWORD)opt->intervalMs : PULSE_DEFAULT_INTERVAL_MS;
+    while (iv >= PULSE_MIN_INTERVAL_MS && (bad || iv <= CAL_MAX_MS))
+    {
+        DWORD hold = 2 * iv + CAL_SETTLE_MS;
+        InterlockedExchange(&g_pulseOverrideMs, (LONG)iv);
+        dlog("Calibrate: pulse every %lu ms, watching for %lu s... ", (unsigned long)iv, (unsigned long)(hold / 1000));
+        int verdict = calibrate_wait(in, hold);
+        if (verdict < 0)
         {
-            opt->db = parse_double(next_arg_value(i, argc, argv), opt->db);
-            ++i;
-            continue;
+            dlog("stopped\n");
+            return;
         }
-        if (str_eq_ci(a, "--rate"))
-        {
-            opt->rate = parse_int(next_arg_value(i, argc, argv), opt->rate);
-            ++i;
+        dlog(verdict ? "kept awake\n" : "dropped out\n");
+        if (verdict)
+            good = iv;
+        else
+            bad = iv;
+        if (bad && bad - good <= max(CAL_RESOLUTION_MS, good / 8))
+            break;
+        iv = bad ? good + (bad - good) / 2 : iv * 2;
+    }
+    if (good == 0)
+    {
+        dlog("Calibrate: even %lu ms was too long; this device needs the continuous tone\n", (unsigned long)bad);
+        return;
+    }
+    DWORD ms = max(PULSE_MIN_INTERVAL_MS, good * 3 / 4);
+    for (int i = 0; i < g_numStreams; ++i)
+    {
+        wchar_t endpoint[256];
+        if (!stream_endpoint(&g_streams[i], endpoint, _countof(endpoint)))
             continue;
-        }
-        if (str_eq_ci(a, "--device"))
-        {
-            opt->deviceIndex = parse_int(next_arg_value(i, argc, argv), opt->deviceIndex);
-            ++i;
+        store_pulse_interval(endpoint, ms);
+        dlog("[dev %d] --synth pulse will use %lu ms (longest that kept it awake: %lu ms)\n", g_streams[i].deviceIndex,
+             (unsigned long)ms, (unsigned long)good);
+    }
+}
+
+// The prompts block for minutes, so calibration gets its own thread and the main thread stays
+// in its message loop for logoff (the worker's streams are already running).
+static DWORD WINAPI CalibrationThreadProc(LPVOID lp)
+{
+    BOOL comOk = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+    run_calibration((const Options *)lp);
+    if (comOk)
+        CoUninitialize();
+    request_shutdown("calibration finished");
+    return 0;
+}
+
+// UTF-8 copies of CommandLineToArgvW's strings (HeapAlloc; released by free_args).
+static char **utf8_args(int argc, LPWSTR *argvw)
+{
+    char **argv = (char **)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(char *) * (argc > 0 ? argc : 1));
+    if (!argv)
+        return NULL;
+    for (int i = 0; i < argc; ++i)
+    {
+        int len = WideCharToMultiByte(CP_UTF8, 0, argvw[i], -1, NULL, 0, NULL, NULL);
+        argv[i] = (char *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, len);
+        if (argv[i])
+            WideCharToMultiByte(CP_UTF8, 0, argvw[i], -1, argv[i], len, NULL, NULL);
+    }
+    return argv;
+}
+
+static void free_args(int *argc, char ***argv, LPWSTR **argvw)
+{
+    for (int i = 0; *argv && i < *argc; ++i)
+        if ((*argv)[i])
+            HeapFree(GetProcessHeap(), 0, (*argv)[i]);
+    if (*argv)
+        HeapFree(GetProcessHeap(), 0, *argv);
+    if (*argvw)
+        LocalFree(*argvw);
+    *argc = 0;
+    *argv = NULL;
+    *argvw = NULL;
+}
+
+// Control pipe name for this logon session (pipe names, unlike Local\ objects, are global).
+// The service has one machine-wide name.
+static void pipe_name(wchar_t *buf, size_t cap, BOOL service)
+{
+    DWORD session = 0;
+    if (service)
+    {
+        wcsncpy(buf, SERVICE_PIPE, cap);
+        buf[cap - 1] = L'\0';
+        return;
+    }
+    ProcessIdToSessionId(GetCurrentProcessId(), &session);
+    _snwprintf(buf, cap, L"\\\\.\\pipe\\KeepAudio.%lu", (unsigned long)session);
+    buf[cap - 1] = L'\0';
+}
+
+// Wait for the next client. The event is signalled when one connects (or already has).
+static BOOL pipe_listen(void)
+{
+    ZeroMemory(&g_pipeOv, sizeof(g_pipeOv));
+    g_pipeOv.hEvent = g_pipeEvent;
+    if (ConnectNamedPipe(g_pipe, &g_pipeOv))
+        return SetEvent(g_pipeEvent);
+    DWORD err = GetLastError();
+    if (err == ERROR_PIPE_CONNECTED)
+        return SetEvent(g_pipeEvent);
+    return err == ERROR_IO_PENDING;
+}
+
+static void pipe_close(void)
+{
+    if (g_pipe != INVALID_HANDLE_VALUE)
+    {
+        CancelIo(g_pipe);
+        CloseHandle(g_pipe);
+        g_pipe = INVALID_HANDLE_VALUE;
+    }
+    if (g_pipeEvent)
+    {
+        CloseHandle(g_pipeEvent);
+        g_pipeEvent = NULL;
+    }
+}
+
+// First instance in the session: own the mutex and open the control pipe right away, so a
+// second start during our own device open already finds someone to talk to.
+static BOOL pipe_serve_start(void)
+{
+    wchar_t name[64];
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, FALSE};
+    pipe_name(name, _countof(name), g_asService);
+    // The default DACL would give other accounts read access only.
+    if (g_asService && !ConvertStringSecurityDescriptorToSecurityDescriptorW(SERVICE_PIPE_SDDL, SDDL_REVISION_1,
+                                                                             &sa.lpSecurityDescriptor, NULL))
+        return FALSE;
+    g_pipeEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    g_requestAck = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!g_pipeEvent || !g_requestAck)
+        return FALSE;
+    DWORD bytes = PIPE_MSG_CHARS * sizeof(wchar_t);
+    g_pipe = CreateNamedPipeW(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                              PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, bytes, bytes,
+                              PIPE_TIMEOUT_MS, sa.lpSecurityDescriptor ? &sa : NULL);
+    if (sa.lpSecurityDescriptor)
+        LocalFree(sa.lpSecurityDescriptor);
+    if (g_pipe == INVALID_HANDLE_VALUE || !pipe_listen())
+    {
+        dlog("Control pipe %ls unavailable (%lu); later starts will run separately\n", name, (unsigned long)GetLastError());
+        pipe_close();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Finish an overlapped pipe operation within PIPE_TIMEOUT_MS.
+static BOOL pipe_wait(BOOL started, DWORD *bytes)
+{
+    if (!started && GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+    if (WaitForSingleObject(g_pipeEvent, PIPE_TIMEOUT_MS) != WAIT_OBJECT_0)
+        CancelIo(g_pipe);
+    return GetOverlappedResult(g_pipe, &g_pipeOv, bytes, TRUE);
+}
+
+// Dispatch everything queued for the main thread's window (WM_ENDSESSION, WM_POWERBROADCAST).
+static void pump_messages(void)
+{
+    MSG msg;
+    while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+    {
+        if (msg.message == WM_QUIT)
+            request_shutdown("WM_QUIT");
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+}
+
+// Hand the posted request (g_requestBusy already taken) to the worker and wait for its answer.
+// Runs on the main thread, so keep pumping: logoff and suspend must not queue up behind it.
+static void pipe_post(LONG bits, wchar_t *reply, size_t cap)
+{
+    HANDLE wait[2] = {g_requestAck, g_shutdownEvent};
+    DWORD n = g_shutdownEvent ? 2 : 1, w;
+    double deadline = now_ms() + REQUEST_WAIT_MS;
+    ResetEvent(g_requestAck);
+    signal_worker(bits);
+    for (;;)
+    {
+        double left = deadline - now_ms();
+        w = MsgWaitForMultipleObjectsEx(n, wait, left > 0 ? (DWORD)ceil(left) : 0, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        if (w != WAIT_OBJECT_0 + n)
+            break;
+        pump_messages();
+    }
+    if (w == WAIT_OBJECT_0)
+        _snwprintf(reply, cap, L"%ls", g_requestReply);
+    else
+        _snwprintf(reply, cap, L"accepted; the worker has not answered yet");
+}
+
+// Parse a flag string (another instance's, or a profile section's) as a command line.
+static BOOL parse_args_line(const wchar_t *args, Options *opt)
+{
+    // CommandLineToArgvW treats the first token as the program name.
+    wchar_t line[PIPE_MSG_CHARS + 16];
+    _snwprintf(line, _countof(line), L"keepaudio %ls", args);
+    line[_countof(line) - 1] = L'\0';
+    int argc = 0;
+    LPWSTR *argvw = CommandLineToArgvW(line, &argc);
+    char **argv = argvw ? utf8_args(argc, argvw) : NULL;
+    BOOL ok = argv != NULL;
+    if (ok)
+    {
+        BOOL listOnly = FALSE;
+        parse_options(argc, argv, opt, &listOnly);
+    }
+    free_args(&argc, &argv, &argvw);
+    return ok;
+}
+
+// Service pipe: TRUE when the client is SYSTEM or an elevated administrator. Anything that
+// changes what every session hears needs that; interactive users get the safe subset.
+static BOOL pipe_client_is_admin(void)
+{
+    BYTE admins[SECURITY_MAX_SID_SIZE], system[SECURITY_MAX_SID_SIZE];
+    DWORD adminsLen = sizeof(admins), systemLen = sizeof(system);
+    BOOL isAdmin = FALSE, isSystem = FALSE;
+    HANDLE tok = NULL;
+    if (!ImpersonateNamedPipeClient(g_pipe))
+        return FALSE;
+    if (OpenThreadToken(GetCurrentThread(), TOKEN_QUERY, TRUE, &tok))
+    {
+        if (CreateWellKnownSid(WinBuiltinAdministratorsSid, NULL, admins, &adminsLen))
+            CheckTokenMembership(tok, admins, &isAdmin);
+        if (CreateWellKnownSid(WinLocalSystemSid, NULL, system, &systemLen))
+            CheckTokenMembership(tok, system, &isSystem);
+        CloseHandle(tok);
+    }
+    // Carrying on under the client's identity would be worse than stopping.
+    if (!RevertToSelf())
+        ExitProcess(1);
+    return isAdmin || isSystem;
+}
+
+// A join from a non-admin client: its endpoint selection and tone, everything else (backend,
+// exclusive mode, format, buffering) as this instance runs.
+static void join_restrict(Options *req)
+{
+    Options o = g_config;
+    memcpy(o.devices, req->devices, sizeof(o.devices));
+    o.numDevices = req->numDevices;
+    o.allDevices = req->allDevices;
+    wcscpy(o.deviceId, req->deviceId);
+    wcscpy(o.deviceName, req->deviceName);
+    o.freq = req->freq;
+    o.db = req->db;
+    o.synth = req->synth;
+    o.intervalMs = req->intervalMs;
+    *req = o;
+}
+
+// "join <args>": parse the other instance's flags and let the worker add its streams.
+static void pipe_join(wchar_t *args, BOOL admin, wchar_t *reply, size_t cap)
+{
+    if (InterlockedCompareExchange(&g_requestBusy, 1, 0) != 0)
+    {
+        _snwprintf(reply, cap, L"busy with an earlier request");
+        return;
+    }
+    if (!parse_args_line(args, &g_joinRequest))
+    {
+        InterlockedExchange(&g_requestBusy, 0);
+        _snwprintf(reply, cap, L"bad request");
+        return;
+    }
+    if (!admin)
+        join_restrict(&g_joinRequest);
+    pipe_post(DEVEV_JOIN, reply, cap);
+}
+
+// "set-level DB", "set-frequency HZ", "pause", "resume", "dump-stats". Only dump-stats leaves
+// the tone alone, so on the service the rest need an administrator.
+static void pipe_control(const wchar_t *req, BOOL admin, wchar_t *reply, size_t cap)
+{
+    static const struct
+    {
+        const wchar_t *name;
+        ControlOp op;
+        BOOL value;
+        BOOL changes;
+    } kCommands[] = {{L"set-level", CTL_SET_LEVEL, TRUE, TRUE},
+                     {L"set-frequency", CTL_SET_FREQUENCY, TRUE, TRUE},
+                     {L"pause", CTL_PAUSE, FALSE, TRUE},
+                     {L"resume", CTL_RESUME, FALSE, TRUE},
+                     {L"dump-stats", CTL_DUMP_STATS, FALSE, FALSE}};
+    for (size_t c = 0; c < _countof(kCommands); ++c)
+    {
+        size_t n = wcslen(kCommands[c].name);
+        if (_wcsnicmp(req, kCommands[c].name, n) != 0 || (req[n] != L'\0' && req[n] != L' '))
             continue;
-        }
-        if (str_eq_ci(a, "--channels"))
+        wchar_t *end = NULL;
+        double v = wcstod(req + n, &end);
+        if (kCommands[c].value && end == req + n)
         {
-            opt->channels = parse_int(next_arg_value(i, argc, argv), opt->channels);
-            ++i;
-            continue;
+            _snwprintf(reply, cap, L"%ls needs a value", kCommands[c].name);
+            return;
         }
-        if (str_eq_ci(a, "--frames"))
+        if (kCommands[c].changes && !admin)
         {
-            opt->bufferFrames = parse_int(next_arg_value(i, argc, argv), opt->bufferFrames);
-            ++i;
-            continue;
+            _snwprintf(reply, cap, L"%ls on the service needs an elevated administrator", kCommands[c].name);
+            return;
         }
-        if (str_eq_ci(a, "--buffers"))
+        if (InterlockedCompareExchange(&g_requestBusy, 1, 0) != 0)
         {
-            opt->numBuffers = parse_int(next_arg_value(i, argc, argv), opt->numBuffers);
-            ++i;
-            continue;
+            _snwprintf(reply, cap, L"busy with an earlier request");
+            return;
         }
-        if (str_eq_ci(a, "--chance"))
+        g_controlOp = kCommands[c].op;
+        g_controlValue = v;
+        pipe_post(DEVEV_CONTROL, reply, cap);
+        return;
+    }
+    _snwprintf(reply, cap, L"unknown command (set-level, set-frequency, pause, resume, dump-stats)");
+}
+
+// One client per connection: read its request, answer, disconnect, listen again.
+static void pipe_serve(void)
+{
+    wchar_t req[PIPE_MSG_CHARS];
+    wchar_t reply[PIPE_MSG_CHARS];
+    DWORD bytes = 0;
+    reply[0] = L'\0';
+    ZeroMemory(&g_pipeOv, sizeof(g_pipeOv));
+    g_pipeOv.hEvent = g_pipeEvent;
+    if (pipe_wait(ReadFile(g_pipe, req, sizeof(req) - sizeof(wchar_t), NULL, &g_pipeOv), &bytes))
+    {
+        req[bytes / sizeof(wchar_t)] = L'\0';
+        // The session pipe only lets its own user in; the service's is open to everyone logged on.
+        BOOL admin = !g_asService || pipe_client_is_admin();
+        if (wcsncmp(req, L"join ", 5) == 0)
+            pipe_join(req + 5, admin, reply, _countof(reply));
+        else
+            pipe_control(req, admin, reply, _countof(reply));
+        reply[_countof(reply) - 1] = L'\0';
+        ZeroMemory(&g_pipeOv, sizeof(g_pipeOv));
+        g_pipeOv.hEvent = g_pipeEvent;
+        DWORD len = (DWORD)((wcslen(reply) + 1) * sizeof(wchar_t));
+        pipe_wait(WriteFile(g_pipe, reply, len, NULL, &g_pipeOv), &bytes);
+    }
+    DisconnectNamedPipe(g_pipe);
+    if (!pipe_listen())
+    {
+        dlog("Control pipe listen failed (%lu); closing it\n", (unsigned long)GetLastError());
+        pipe_close();
+    }
+}
+
+// Client side of the control pipe. With retry, keep trying while the pipe does not exist yet
+// (a first instance creates it just after the mutex).
+static BOOL pipe_call(BOOL service, const wchar_t *req, wchar_t *reply, size_t cap, BOOL retry)
+{
+    wchar_t name[64];
+    DWORD got = 0;
+    pipe_name(name, _countof(name), service);
+    DWORD len = (DWORD)((wcslen(req) + 1) * sizeof(wchar_t));
+    for (int tries = 0; tries < (retry ? PIPE_TIMEOUT_MS / 100 : 1); ++tries)
+    {
+        if (tries)
+            Sleep(100);
+        if (CallNamedPipeW(name, (LPVOID)req, len, reply, (DWORD)((cap - 1) * sizeof(wchar_t)), &got, PIPE_TIMEOUT_MS))
         {
-            opt->chance = parse_int(next_arg_value(i, argc, argv), opt->chance);
-            ++i;
-            continue;
+            reply[got / sizeof(wchar_t)] = L'\0';
+            return TRUE;
         }
-        if (str_eq_ci(a, "--format"))
+        if (GetLastError() != ERROR_FILE_NOT_FOUND)
+            break;
+    }
+    return FALSE;
+}
+
+// Later instance: send our flags to the running one (the session's, or the service). FALSE
+// when nobody answered, in which case the caller runs on its own.
+static BOOL hand_over(int argc, char **argv, BOOL service)
+{
+    wchar_t req[PIPE_MSG_CHARS];
+    wchar_t reply[PIPE_MSG_CHARS];
+    wcscpy(req, L"join ");
+    build_persisted_args_w(argc, argv, req + 5, _countof(req) - 5);
+    if (pipe_call(service, req, reply, _countof(reply), TRUE))
+    {
+        dlog("KeepAudio is already running%s; handed over: %ls\n", service ? " as a service" : "", reply);
+        return TRUE;
+    }
+    dlog("KeepAudio is already running but its control pipe did not answer (%lu); starting separately\n",
+         (unsigned long)GetLastError());
+    return FALSE;
+}
+
+// --control: one command to the running instance; the answer goes to the console or a MessageBox.
+static void send_control(const char *cmd, BOOL console)
+{
+    wchar_t req[64];
+    wchar_t reply[PIPE_MSG_CHARS];
+    MultiByteToWideChar(CP_UTF8, 0, cmd, -1, req, (int)_countof(req));
+    req[_countof(req) - 1] = L'\0';
+    if (!pipe_call(FALSE, req, reply, _countof(reply), FALSE) && !pipe_call(TRUE, req, reply, _countof(reply), FALSE))
+        _snwprintf(reply, _countof(reply), L"No running KeepAudio instance answered (%lu)", (unsigned long)GetLastError());
+    reply[_countof(reply) - 1] = L'\0';
+    if (console)
+        dlog("%ls\n", reply);
+    else
+        MessageBoxW(NULL, reply, L"KeepAudio", MB_OK | MB_ICONINFORMATION);
+}
+
+// Profiles, main thread: read and watch the file; the worker applies it (DEVEV_PROFILES).
+static BOOL *profile_switch(Options *opt, const wchar_t *key)
+{
+    if (_wcsicmp(key, L"static") == 0)
+        return &opt->staticBuffers;
+    if (_wcsicmp(key, L"lock-memory") == 0)
+        return &opt->lockMemory;
+    if (_wcsicmp(key, L"adaptive") == 0)
+        return &opt->adaptive;
+    if (_wcsicmp(key, L"exclusive") == 0)
+        return &opt->exclusive;
+    if (_wcsicmp(key, L"min-period") == 0)
+        return &opt->minPeriod;
+    return NULL;
+}
+static BOOL profile_value_key(const wchar_t *key)
+{
+    static const wchar_t *const kKeys[] = {L"freq",   L"db",     L"rate",     L"channels", L"frames",
+                                           L"buffers", L"format", L"synth", L"interval", L"backend"};
+    for (size_t i = 0; i < _countof(kKeys); ++i)
+        if (_wcsicmp(key, kKeys[i]) == 0)
+            return TRUE;
+    return FALSE;
+}
+static wchar_t *trim_w(wchar_t *s)
+{
+    while (*s == L' ' || *s == L'\t')
+        ++s;
+    size_t n = wcslen(s);
+    while (n && (s[n - 1] == L' ' || s[n - 1] == L'\t'))
+        s[--n] = L'\0';
+    return s;
+}
+
+// Whoever can write the profiles file picks every stream's device and tone, the service's
+// included. Trust SYSTEM, Administrators and this process's own account.
+static BOOL profile_writer_trusted(PSID sid, PSID self)
+{
+    return IsWellKnownSid(sid, WinLocalSystemSid) || IsWellKnownSid(sid, WinBuiltinAdministratorsSid) ||
+           (self && EqualSid(sid, self));
+}
+// TRUE when only trusted accounts own the file or may write it (the owner can rewrite the DACL).
+static BOOL profiles_trusted(const wchar_t *path)
+{
+    const DWORD writeMask = FILE_WRITE_DATA | FILE_APPEND_DATA | WRITE_DAC | WRITE_OWNER | DELETE | GENERIC_WRITE | GENERIC_ALL;
+    DWORD sd[1024], user[64], need = 0; // DWORD arrays keep the SIDs and ACLs aligned
+    PSID owner = NULL, self = NULL;
+    PACL dacl = NULL;
+    BOOL present = FALSE, defaulted = FALSE;
+    HANDLE tok = NULL;
+    if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &tok))
+    {
+        if (GetTokenInformation(tok, TokenUser, user, sizeof(user), &need))
+            self = ((TOKEN_USER *)user)->User.Sid;
+        CloseHandle(tok);
+    }
+    if (!GetFileSecurityW(path, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, sd, sizeof(sd), &need) ||
+        !GetSecurityDescriptorOwner(sd, &owner, &defaulted) || !GetSecurityDescriptorDacl(sd, &present, &dacl, &defaulted))
+        return FALSE;
+    if (!owner || !profile_writer_trusted(owner, self) || !present || !dacl)
+        return FALSE; // no DACL at all lets everyone write
+    for (DWORD i = 0; i < dacl->AceCount; ++i)
+    {
+        ACCESS_ALLOWED_ACE *ace = NULL;
+        if (!GetAce(dacl, i, (LPVOID *)&ace))
+            return FALSE;
+        if (ace->Header.AceType == ACCESS_DENIED_ACE_TYPE)
+            continue; // only takes rights away
+        if (ace->Header.AceType != ACCESS_ALLOWED_ACE_TYPE ||
+            ((ace->Mask & writeMask) && !profile_writer_trusted((PSID)&ace->SidStart, self)))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Read every section of the profiles file into out[]. A missing file means no profiles, and so
+// does one that someone untrusted could have written.
+static int profiles_load(Profile *out, int cap)
+{
+    static wchar_t names[8192], keys[4096];
+    if (GetFileAttributesW(g_profilePath) == INVALID_FILE_ATTRIBUTES)
+        return 0;
+    if (!profiles_trusted(g_profilePath))
+    {
+        dlog("Profiles: %ls is owned or writable by an account other than SYSTEM, Administrators or this one; "
+             "ignoring it\n",
+             g_profilePath);
+        return 0;
+    }
+    if (!GetPrivateProfileSectionNamesW(names, _countof(names), g_profilePath))
+        return 0;
+    int count = 0;
+    for (const wchar_t *sec = names; *sec && count < cap; sec += wcslen(sec) + 1)
+    {
+        Profile *p = &out[count];
+        wchar_t line[PIPE_MSG_CHARS];
+        wchar_t *off[8];
+        int numOff = 0;
+        size_t len = 0;
+        line[0] = L'\0';
+        wappend(line, _countof(line), &len, g_baseArgs);
+        GetPrivateProfileSectionW(sec, keys, _countof(keys), g_profilePath);
+        for (wchar_t *kv = keys, *nextKv; *kv; kv = nextKv)
         {
-            const char *v = next_arg_value(i, argc, argv);
-            ++i;
-            if (v)
+            nextKv = kv + wcslen(kv) + 1;
+            wchar_t *eq = wcschr(kv, L'=');
+            if (eq)
+                *eq = L'\0';
+            wchar_t *key = trim_w(kv), *val = eq ? trim_w(eq + 1) : L"1";
+            if (!key[0] || key[0] == L';' || key[0] == L'#')
+                continue;
+            wchar_t flag[64];
+            _snwprintf(flag, _countof(flag), L"--%ls", key);
+            flag[_countof(flag) - 1] = L'\0';
+            if (profile_value_key(key) && val[0])
             {
-                if (str_eq_ci(v, "auto"))
-                    opt->reqFmt = FMT_AUTO;
-                else if (str_eq_ci(v, "pcm16"))
-                    opt->reqFmt = FMT_PCM16;
-                else if (str_eq_ci(v, "float32"))
-                    opt->reqFmt = FMT_FLOAT32;
+                wappend_ch(line, _countof(line), &len, L' ');
+                wappend(line, _countof(line), &len, flag);
+                wappend_ch(line, _countof(line), &len, L' ');
+                append_quoted_arg_w(line, _countof(line), &len, val);
+            }
+            else if (profile_switch(&p->opt, key))
+            {
+                // 0/false/off turns off a switch the command line set.
+                BOOL on = wcstol(val, NULL, 10) != 0 || _wcsicmp(val, L"true") == 0 || _wcsicmp(val, L"yes") == 0 ||
+                          _wcsicmp(val, L"on") == 0;
+                if (on)
+                {
+                    wappend_ch(line, _countof(line), &len, L' ');
+                    wappend(line, _countof(line), &len, flag);
+                }
+                else if (numOff < (int)_countof(off))
+                {
+                    off[numOff++] = key;
+                }
+            }
+            else
+            {
+                dlog("Profile [%ls]: unknown key \"%ls\" ignored\n", sec, key);
             }
-            continue;
         }
+        if (!parse_args_line(line, &p->opt))
+            continue;
+        for (int k = 0; k < numOff; ++k)
+            *profile_switch(&p->opt, off[k]) = FALSE;
+        // The section name picks the endpoint: an MMDevice ID ({0.0.0.00000000}.{...}) or a
+        // friendly-name fragment, as with --device-name.
+        BOOL byId = wcsncmp(sec, L"{0.0.0.", 7) == 0;
+        wchar_t *dst = byId ? p->opt.deviceId : p->opt.deviceName;
+        size_t dstCap = byId ? _countof(p->opt.deviceId) : _countof(p->opt.deviceName);
+        wcsncpy(dst, sec, dstCap - 1);
+        dst[dstCap - 1] = L'\0';
+        (byId ? p->opt.deviceName : p->opt.deviceId)[0] = L'\0';
+        p->opt.allDevices = FALSE;
+        wcsncpy(p->name, sec, _countof(p->name) - 1);
+        p->name[_countof(p->name) - 1] = L'\0';
+        ++count;
     }
-    opt->freq = clamp_double(opt->freq, 0.1, 2000.0);
-    opt->db = clamp_double(opt->db, -150.0, -10.0);
-    if (opt->rate < 8000)
-        opt->rate = 8000;
-    if (opt->rate > 192000)
-        opt->rate = 192000;
-    if (opt->channels != 1 && opt->channels != 2)
-        opt->channels = 1;
-    opt->bufferFrames = clamp_int(opt->bufferFrames, 128, 8192);
-    opt->numBuffers = clamp_int(opt->numBuffers, 2, 32);
-    if (opt->chance != 0)
-        opt->chance = clamp_int(opt->chance, 1, 100);
+    return count;
 }
 
-static void install_startup(int argc, char **argv, const Options *opt)
+static void profiles_close(void)
 {
-    wchar_t exePath[MAX_PATH] = {0};
-    if (!get_exe_path_w(exePath, _countof(exePath)))
+    if (g_profileDir != INVALID_HANDLE_VALUE)
     {
-        dlog("Install: cannot get exe path\n");
-        return;
+        CancelIo(g_profileDir);
+        CloseHandle(g_profileDir);
+        g_profileDir = INVALID_HANDLE_VALUE;
     }
+    if (g_profileEvent)
+    {
+        CloseHandle(g_profileEvent);
+        g_profileEvent = NULL;
+    }
+}
 
-    wchar_t useExe[MAX_PATH] = {0};
-    wcscpy(useExe, exePath);
+// Open the profiles file's directory for watching. While it does not exist (nobody has run
+// --install-service or deployed it yet), watch its parent until it appears.
+static BOOL profiles_watch(void)
+{
+    wchar_t dir[MAX_PATH];
+    wcsncpy(dir, g_profilePath, _countof(dir) - 1);
+    dir[_countof(dir) - 1] = L'\0';
+    wchar_t *slash = wcsrchr(dir, L'\\');
+    if (slash)
+        *slash = L'\0';
+    g_profileWatchParent = FALSE;
+    for (int up = 0; up < 2; ++up)
+    {
+        g_profileDir = CreateFileW(dir, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                   OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        DWORD err = GetLastError();
+        if (g_profileDir != INVALID_HANDLE_VALUE)
+            return TRUE;
+        if (up || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND) || !(slash = wcsrchr(dir, L'\\')))
+            break;
+        *slash = L'\0';
+        g_profileWatchParent = TRUE;
+    }
+    dlog("Profiles: cannot watch %ls (%lu)\n", dir, (unsigned long)GetLastError());
+    return FALSE;
+}
 
-    if (opt->doInstallCopy)
+// Re-arm the directory watch. The event stays set only while a completed read is unhandled.
+static BOOL profiles_arm(void)
+{
+    DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE;
+    ZeroMemory(&g_profileOv, sizeof(g_profileOv));
+    g_profileOv.hEvent = g_profileEvent;
+    if (g_profileWatchParent)
+        filter = FILE_NOTIFY_CHANGE_DIR_NAME;
+    if (ReadDirectoryChangesW(g_profileDir, g_profileNotify, sizeof(g_profileNotify), FALSE, filter, NULL, &g_profileOv,
+                              NULL))
+        return TRUE;
+    dlog("Profiles: watching the directory failed (%lu); edits need a restart\n", (unsigned long)GetLastError());
+    ResetEvent(g_profileEvent);
+    return FALSE;
+}
+
+// The directory watch fired: TRUE when the profiles file (or, watching the parent, its
+// directory) was among the changes, or the record buffer overflowed, which hides them.
+static BOOL profiles_changed(void)
+{
+    DWORD bytes = 0;
+    BOOL hit = FALSE;
+    if (GetOverlappedResult(g_profileDir, &g_profileOv, &bytes, FALSE))
     {
-        wchar_t lad[MAX_PATH] = {0}, targetDir[MAX_PATH] = {0}, targetExe[MAX_PATH] = {0};
-        if (!get_localappdata_w(lad, _countof(lad)))
+        wchar_t part[MAX_PATH];
+        wcsncpy(part, g_profilePath, _countof(part) - 1);
+        part[_countof(part) - 1] = L'\0';
+        wchar_t *slash = wcsrchr(part, L'\\');
+        if (g_profileWatchParent && slash)
         {
-            dlog("Install: cannot resolve LOCALAPPDATA\n");
-            return;
+            *slash = L'\0';
+            slash = wcsrchr(part, L'\\');
         }
-        _snwprintf(targetDir, _countof(targetDir), L"%ls\\KeepAudio", lad);
-        if (!ensure_dir_exists_w(targetDir))
+        const wchar_t *file = slash ? slash + 1 : part;
+        size_t n = wcslen(file);
+        const FILE_NOTIFY_INFORMATION *fi = (const FILE_NOTIFY_INFORMATION *)g_profileNotify;
+        hit = (bytes == 0);
+        while (bytes && !hit)
         {
-            dlog("Install: cannot create dir\n");
-            return;
+            hit = fi->FileNameLength == n * sizeof(wchar_t) && _wcsnicmp(fi->FileName, file, n) == 0;
+            if (!fi->NextEntryOffset)
+                break;
+            fi = (const FILE_NOTIFY_INFORMATION *)((const BYTE *)fi + fi->NextEntryOffset);
         }
-        _snwprintf(targetExe, _countof(targetExe), L"%ls\\keepaudio.exe", targetDir);
-        if (!CopyFileW(exePath, targetExe, FALSE))
+    }
+    if (hit && g_profileWatchParent)
+    {
+        // The directory has appeared: watch it instead (a file may already be in it).
+        CloseHandle(g_profileDir);
+        g_profileDir = INVALID_HANDLE_VALUE;
+        if (!profiles_watch())
         {
-            dlog("Install: copy failed (%lu)\n", GetLastError());
-            return;
+            ResetEvent(g_profileEvent);
+            return TRUE;
         }
-        wcsncpy(useExe, targetExe, _countof(useExe));
-        useExe[_countof(useExe) - 1] = L'\0';
     }
+    profiles_arm();
+    return hit;
+}
 
-    wchar_t args[8192] = {0};
-    build_persisted_args_w(argc, argv, args, _countof(args));
-
-    wchar_t cmdline[9000] = {0};
-    build_cmdline_for_run_w(useExe, args, cmdline, _countof(cmdline));
+// Re-read the file and let the worker apply it. FALSE = an earlier request is still being
+// handled; try again later.
+static BOOL profiles_reload(void)
+{
+    wchar_t reply[256];
+    if (InterlockedCompareExchange(&g_requestBusy, 1, 0) != 0)
+        return FALSE;
+    g_numProfileRequest = profiles_load(g_profileRequest, MAX_STREAMS);
+    pipe_post(DEVEV_PROFILES, reply, _countof(reply));
+    dlog("Profiles: %ls changed; %ls\n", g_profilePath, reply);
+    return TRUE;
+}
 
-    if (reg_set_run_value_w(opt->startupName, cmdline))
-    {
-        dlog("Startup entry set: %ls\n", cmdline);
-    }
+// Startup: load and apply the profiles before the worker runs, then watch their directory so
+// a file pushed or edited later applies live. --bench and --calibrate measure one
+// configuration and skip them.
+static void profiles_start(int argc, char **argv, const Options *opt)
+{
+    if (opt->benchSeconds > 0 || opt->calibrate || _wcsicmp(opt->profiles, L"none") == 0)
+        return;
+    if (opt->profiles[0])
+        GetFullPathNameW(opt->profiles, _countof(g_profilePath), g_profilePath, NULL);
     else
+        ExpandEnvironmentStringsW(PROFILES_DEFAULT, g_profilePath, _countof(g_profilePath));
+    build_persisted_args_w(argc, argv, g_baseArgs, _countof(g_baseArgs));
+    g_numProfiles = profiles_load(g_profiles, MAX_STREAMS);
+    if (g_numProfiles)
     {
-        dlog("Install: failed to set Run value\n");
+        dlog("Profiles: %d section(s) from %ls\n", g_numProfiles, g_profilePath);
+        profiles_apply();
     }
+    if (!profiles_watch())
+        return;
+    g_profileEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!g_requestAck)
+        g_requestAck = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!g_profileEvent || !profiles_arm())
+        profiles_close();
 }
 
-static void uninstall_startup(const Options *opt)
+// Everything run_engine set up that outlives the streams. Safe to call twice; the service
+// calls it on its own thread so COM is uninitialized where it was initialized.
+static void release_engine(void)
 {
-    if (reg_delete_run_value_w(opt->startupName))
+    stats_close();
+    pipe_close();
+    profiles_close();
+    if (g_requestAck)
     {
-        dlog("Startup entry removed: %ls\n", opt->startupName);
+        CloseHandle(g_requestAck);
+        g_requestAck = NULL;
     }
-    else
+    if (g_instanceMutex)
     {
-        dlog("Uninstall: entry not found or failed\n");
+        CloseHandle(g_instanceMutex);
+        g_instanceMutex = NULL;
     }
-    wchar_t lad[MAX_PATH] = {0}, targetDir[MAX_PATH] = {0}, targetExe[MAX_PATH] = {0};
-    if (get_localappdata_w(lad, _countof(lad)))
+    if (g_devEnumerator)
     {
-        _snwprintf(targetDir, _countof(targetDir), L"%ls\\KeepAudio", lad);
-        _snwprintf(targetExe, _countof(targetExe), L"%ls\\KeepAudio\\keepaudio.exe", lad);
-        DeleteFileW(targetExe);
-        RemoveDirectoryW(targetDir);
+        IMMDeviceEnumerator_UnregisterEndpointNotificationCallback(g_devEnumerator, &g_watcher);
+        IMMDeviceEnumerator_Release(g_devEnumerator);
+        g_devEnumerator = NULL;
+    }
+    if (g_shutdownEvent)
+    {
+        CloseHandle(g_shutdownEvent);
+        g_shutdownEvent = NULL;
+    }
+    if (g_deviceChangeEvent)
+    {
+        CloseHandle(g_deviceChangeEvent);
+        g_deviceChangeEvent = NULL;
+    }
+    if (g_displayNotify)
+    {
+        UnregisterPowerSettingNotification(g_displayNotify);
+        g_displayNotify = NULL;
+    }
+    if (g_acdcNotify)
+    {
+        UnregisterPowerSettingNotification(g_acdcNotify);
+        g_acdcNotify = NULL;
+    }
+    if (g_powerAck)
+    {
+        CloseHandle(g_powerAck);
+        g_powerAck = NULL;
+    }
+    if (g_comInit)
+    {
+        CoUninitialize();
+        g_comInit = FALSE;
     }
 }
 
-static BOOL open_audio(const Options *opt)
+// Open the streams and run until shutdown: the body of a normal start and of the service.
+// Returns non-zero when no stream could be opened.
+static int run_engine(Options *opt, HINSTANCE hInst, int *argc, char ***argv, LPWSTR **argvw)
 {
-    // Decide format
-    AudioFormat useFmt = opt->reqFmt;
-    if (useFmt == FMT_AUTO)
-        useFmt = (opt->db <= -96.0) ? FMT_FLOAT32 : FMT_PCM16;
-
-    UINT deviceId = (opt->deviceIndex < 0) ? WAVE_MAPPER : (UINT)opt->deviceIndex;
-    WAVEFORMATEX wfx = {0};
-    MMRESULT mmr;
+    select_kernel(opt->kernel);
+    if (opt->benchSeconds > 0)
+        bench_kernels(opt);
 
-    g_rate = opt->rate;
-    g_channels = opt->channels;
-    g_phase = 0.0;
-    g_phaseStep = 2.0 * M_PI * opt->freq / (double)opt->rate;
-    g_db = opt->db;
-    g_bufferFrames = opt->bufferFrames;
+    if (opt->chance > 0)
+    {
+        rng_seed_from_system();
+        int roll = rng_roll_1_to_100();
+        if (roll <= opt->chance)
+            return 0; // early silent exit
+    }
 
-    if (useFmt == FMT_FLOAT32)
+    // One instance per session: if another is running, give it our devices instead of
+    // opening them a second time. An installed service covers every session.
+    if (g_asService)
     {
-        wfx.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
-        wfx.nChannels = (WORD)opt->channels;
-        wfx.nSamplesPerSec = (DWORD)opt->rate;
-        wfx.wBitsPerSample = 32;
-        wfx.nBlockAlign = (WORD)(wfx.nChannels * (wfx.wBitsPerSample / 8));
-        wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
-        mmr = waveOutOpen(&g_hwo, deviceId, &wfx, 0, 0, CALLBACK_NULL);
-        if (mmr == MMSYSERR_NOERROR)
+        // The default DACL would hide the mutex from the user instances that probe for it.
+        SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, FALSE};
+        ConvertStringSecurityDescriptorToSecurityDescriptorW(SERVICE_MUTEX_SDDL, SDDL_REVISION_1, &sa.lpSecurityDescriptor,
+                                                             NULL);
+        g_instanceMutex = CreateMutexW(sa.lpSecurityDescriptor ? &sa : NULL, FALSE, SERVICE_MUTEX);
+        if (sa.lpSecurityDescriptor)
+            LocalFree(sa.lpSecurityDescriptor);
+        pipe_serve_start();
+    }
+    else if (!opt->standalone)
+    {
+        // Access denied still means it exists (a service started before this DACL was in place).
+        HANDLE svc = OpenMutexW(SYNCHRONIZE, FALSE, SERVICE_MUTEX);
+        if (svc || GetLastError() == ERROR_ACCESS_DENIED)
         {
-            g_usingFloat = TRUE;
+            if (svc)
+                CloseHandle(svc);
+            if (hand_over(*argc, *argv, TRUE))
+                return 0;
         }
-        else
+        g_instanceMutex = CreateMutexW(NULL, FALSE, INSTANCE_MUTEX);
+        if (g_instanceMutex && GetLastError() == ERROR_ALREADY_EXISTS)
         {
-            // Fallback to PCM16
-            wfx.wFormatTag = WAVE_FORMAT_PCM;
-            wfx.wBitsPerSample = 16;
-            wfx.nBlockAlign = (WORD)(wfx.nChannels * (wfx.wBitsPerSample / 8));
-            wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
-            mmr = waveOutOpen(&g_hwo, deviceId, &wfx, 0, 0, CALLBACK_NULL);
-            if (mmr != MMSYSERR_NOERROR)
-                return FALSE;
-            g_usingFloat = FALSE;
+            CloseHandle(g_instanceMutex);
+            g_instanceMutex = NULL;
+            if (hand_over(*argc, *argv, FALSE))
+                return 0;
+        }
+        else if (g_instanceMutex)
+        {
+            pipe_serve_start();
         }
     }
-    else
+
+    // Open audio + prime buffers first: at logon the window and everything else can wait until
+    // the worker is feeding the device.
+    HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    g_comInit = SUCCEEDED(hrCom);
+    g_shutdownEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    g_deviceChangeEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    g_powerAck = CreateEventW(NULL, TRUE, FALSE, NULL);
+    g_config = *opt;
+    // Endpoint watcher: reopen streams on unplug/replug and default-device changes.
+    g_devEnumerator = mm_create_enumerator();
+    if (g_devEnumerator && FAILED(IMMDeviceEnumerator_RegisterEndpointNotificationCallback(g_devEnumerator, &g_watcher)))
     {
-        wfx.wFormatTag = WAVE_FORMAT_PCM;
-        wfx.nChannels = (WORD)opt->channels;
-        wfx.nSamplesPerSec = (DWORD)opt->rate;
-        wfx.wBitsPerSample = 16;
-        wfx.nBlockAlign = (WORD)(wfx.nChannels * (wfx.wBitsPerSample / 8));
-        wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
-        mmr = waveOutOpen(&g_hwo, deviceId, &wfx, 0, 0, CALLBACK_NULL);
-        if (mmr != MMSYSERR_NOERROR && opt->reqFmt == FMT_AUTO)
-        {
-            // try float
-            wfx.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
-            wfx.wBitsPerSample = 32;
-            wfx.nBlockAlign = (WORD)(wfx.nChannels * (wfx.wBitsPerSample / 8));
-            wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
-            mmr = waveOutOpen(&g_hwo, deviceId, &wfx, 0, 0, CALLBACK_NULL);
-            if (mmr == MMSYSERR_NOERROR)
-                g_usingFloat = TRUE;
-        }
-        if (mmr != MMSYSERR_NOERROR)
-            return FALSE;
+        IMMDeviceEnumerator_Release(g_devEnumerator);
+        g_devEnumerator = NULL;
+    }
+    if (g_shutdownEvent && g_deviceChangeEvent)
+    {
+        open_streams(&g_config);
+        profiles_start(*argc, *argv, opt);
+    }
+    if (g_numStreams == 0)
+    {
+        dlog("Audio open failed. Try different --rate/--channels/--device or --format.\n");
+        return 1;
     }
 
-    // Allocate buffers/headers and prime
-    g_numBuffers = opt->numBuffers;
-    int bytesPerFrame = (g_usingFloat ? (int)(g_channels * 4) : (int)(g_channels * 2));
-    g_bufBytes = g_bufferFrames * bytesPerFrame;
+    g_startupUs = (LONGLONG)(process_age_ms() * 1000.0);
+    dlog("Startup: %d stream(s) primed %.1f ms after process start\n", g_numStreams, g_startupUs / 1000.0);
+    KA_TRACE("Startup", WINEVENT_LEVEL_INFO, KA_KW_LIFECYCLE, TraceLoggingInt32(g_numStreams, "Streams"),
+             TraceLoggingInt64(g_startupUs, "StartupUs"), TraceLoggingBoolean(g_asService, "Service"));
+    stats_open();
+    stats_publish();
 
-    g_buffers = (void **)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(void *) * g_numBuffers);
-    g_headers = (WAVEHDR *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(WAVEHDR) * g_numBuffers);
-    if (!g_buffers || !g_headers)
-        return FALSE;
+    // Start audio worker
+    double benchStartMs = now_ms(); // also the --lean trim reference
+    double benchStartCpuMs = process_cpu_ms();
+    if (opt->eco)
+        enable_eco_qos();
+    g_audioThread = CreateThread(NULL, 0, AudioThreadProc, NULL, 0, NULL);
 
-    double lin = pow(10.0, g_db / 20.0);
+    // Display/AC notifications arrive right away with the current state, then on each change.
+    // A service gets them (and stop/shutdown) through its control handler instead of a window.
+    if (g_asService)
+    {
+        g_displayNotify = RegisterPowerSettingNotification(g_serviceHandle, &KA_GUID_CONSOLE_DISPLAY_STATE, DEVICE_NOTIFY_SERVICE_HANDLE);
+        g_acdcNotify = RegisterPowerSettingNotification(g_serviceHandle, &KA_GUID_ACDC_POWER_SOURCE, DEVICE_NOTIFY_SERVICE_HANDLE);
+        service_report(SERVICE_RUNNING, NO_ERROR, 0);
+    }
+    else
+    {
+        // Hidden window (logoff, power) only once audio runs: register the class and create a
+        // never-shown top-level window.
+        const wchar_t *clsName = L"KeepAudioHiddenClass";
+        WNDCLASSW wc = {0};
+        wc.lpfnWndProc = HiddenWndProc;
+        wc.hInstance = hInst;
+        wc.lpszClassName = clsName;
+        RegisterClassW(&wc);
+        HWND hwnd = CreateWindowExW(WS_EX_TOOLWINDOW, clsName, L"KeepAudio", WS_POPUP, 0, 0, 0, 0, NULL, NULL, hInst, NULL);
+        if (!hwnd)
+            dlog("Hidden window creation failed (%lu); logoff will not be noticed\n", (unsigned long)GetLastError());
+        if (hwnd)
+        {
+            g_displayNotify = RegisterPowerSettingNotification(hwnd, &KA_GUID_CONSOLE_DISPLAY_STATE, DEVICE_NOTIFY_WINDOW_HANDLE);
+            g_acdcNotify = RegisterPowerSettingNotification(hwnd, &KA_GUID_ACDC_POWER_SOURCE, DEVICE_NOTIFY_WINDOW_HANDLE);
+        }
+    }
+    HANDLE calThread = NULL;
+    if (opt->calibrate)
+    {
+        calThread = CreateThread(NULL, 0, CalibrationThreadProc, (LPVOID)opt, 0, NULL);
+        if (!calThread)
+            request_shutdown("calibration thread failed");
+    }
+    BOOL leanTrimmed = FALSE;
+    if (opt->lean)
+        free_args(argc, argv, argvw); // nothing reads the command line past this point
 
-    for (int i = 0; i < g_numBuffers; ++i)
+    // Block until a message arrives, shutdown is requested, the worker exits, or a timed job
+    // (--bench end, --lean trim) is due. No polling: the main thread sleeps otherwise.
+    HANDLE waitHandles[4];
+    DWORD nWait = 0, pipeSlot = MAXDWORD, profileSlot = MAXDWORD;
+    double profileDueMs = 0; // when a changed profiles file has settled; 0 = nothing pending
+    waitHandles[nWait++] = g_shutdownEvent;
+    if (g_audioThread)
+        waitHandles[nWait++] = g_audioThread;
+    if (g_profileEvent)
     {
-        g_buffers[i] = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, g_bufBytes);
-        if (!g_buffers[i])
-            return FALSE;
-        ZeroMemory(&g_headers[i], sizeof(WAVEHDR));
-        g_headers[i].lpData = (LPSTR)g_buffers[i];
-        g_headers[i].dwBufferLength = (DWORD)g_bufBytes;
+        profileSlot = nWait;
+        waitHandles[nWait++] = g_profileEvent;
+    }
+    if (g_pipeEvent)
+    {
+        pipeSlot = nWait;
+        waitHandles[nWait++] = g_pipeEvent;
+    }
+    while (InterlockedCompareExchange(&g_running, 1, 1))
+    {
+        double elapsed = now_ms() - benchStartMs;
+        double due = -1.0; // ms until the next timed job; < 0 = none
+        if (opt->benchSeconds > 0)
+            due = opt->benchSeconds * 1000.0 - elapsed;
+        if (opt->lean && !leanTrimmed && (due < 0 || LEAN_TRIM_DELAY_MS - elapsed < due))
+            due = LEAN_TRIM_DELAY_MS - elapsed;
+        if (profileDueMs > 0 && (due < 0 || profileDueMs - now_ms() < due))
+            due = profileDueMs - now_ms();
+        BOOL timed = opt->benchSeconds > 0 || (opt->lean && !leanTrimmed) || profileDueMs > 0;
+        DWORD timeout = timed ? (due > 0 ? (DWORD)ceil(due) : 0) : INFINITE;
 
-        if (g_usingFloat)
+        DWORD w = MsgWaitForMultipleObjectsEx(nWait, waitHandles, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+        if (w == WAIT_OBJECT_0 + nWait)
         {
-            float amp = (float)lin;
-            fill_sine_f32((float *)g_buffers[i], g_bufferFrames, g_channels, &g_phase, g_phaseStep, amp);
+            pump_messages();
         }
-        else
+        else if (g_profileEvent && w == WAIT_OBJECT_0 + profileSlot)
+        {
+            if (profiles_changed())
+                profileDueMs = now_ms() + PROFILE_SETTLE_MS; // restarts with every write
+        }
+        else if (g_pipeEvent && w == WAIT_OBJECT_0 + pipeSlot)
+        {
+            pipe_serve();
+            if (!g_pipeEvent)
+                --nWait; // the pipe is always the last slot
+        }
+        else if (w != WAIT_TIMEOUT)
+        {
+            // Shutdown event, worker gone, or the wait itself failed.
+            request_shutdown(w == WAIT_OBJECT_0 + 1 ? "audio worker exited" : "main wait ended");
+            break;
+        }
+        elapsed = now_ms() - benchStartMs;
+        if (opt->benchSeconds > 0 && elapsed >= opt->benchSeconds * 1000.0)
+            request_shutdown("--bench finished");
+        if (opt->lean && !leanTrimmed && elapsed >= LEAN_TRIM_DELAY_MS)
         {
-            double scaled = lin * 32767.0;
-            if (scaled < 1.0)
-                scaled = 1.0;
-            if (scaled > 32767.0)
-                scaled = 32767.0;
-            int16_t amp = (int16_t)floor(scaled + 0.5);
-            fill_sine_i16((int16_t *)g_buffers[i], g_bufferFrames, g_channels, &g_phase, g_phaseStep, amp);
+            lean_trim();
+            leanTrimmed = TRUE;
         }
+        if (profileDueMs > 0 && now_ms() >= profileDueMs)
+            profileDueMs = profiles_reload() ? 0 : now_ms() + PROFILE_SETTLE_MS;
+    }
 
-        MMRESULT mmr2 = waveOutPrepareHeader(g_hwo, &g_headers[i], sizeof(WAVEHDR));
-        if (mmr2 != MMSYSERR_NOERROR)
-            return FALSE;
-        mmr2 = waveOutWrite(g_hwo, &g_headers[i], sizeof(WAVEHDR));
-        if (mmr2 != MMSYSERR_NOERROR)
-            return FALSE;
+    // Stop thread + audio (wake the worker out of its wait so it sees g_running == 0)
+    if (g_shutdownEvent)
+        SetEvent(g_shutdownEvent);
+    if (calThread)
+    {
+        // Its prompt also waits on the shutdown event; it reads g_streams, so join it first.
+        WaitForSingleObject(calThread, WORKER_EXIT_WAIT_MS);
+        CloseHandle(calThread);
     }
-    return TRUE;
+    if (g_audioThread)
+    {
+        if (WaitForSingleObject(g_audioThread, WORKER_EXIT_WAIT_MS) == WAIT_TIMEOUT)
+            dlog("Audio worker did not stop within %d ms\n", WORKER_EXIT_WAIT_MS);
+        if (opt->statsSeconds > 0)
+            stats_log(NULL, 0);
+        if (opt->benchSeconds > 0)
+            bench_report(now_ms() - benchStartMs, process_cpu_ms() - benchStartCpuMs, thread_cpu_ms(g_audioThread));
+        CloseHandle(g_audioThread);
+        g_audioThread = NULL;
+    }
+    double workerMs = now_ms() - g_shutdownAtMs;
+    close_streams();
+    double totalMs = now_ms() - g_shutdownAtMs;
+    dlog("Teardown: worker stopped %.1f ms after the request, streams closed %.1f ms later\n", workerMs,
+         totalMs - workerMs);
+    KA_TRACE("Teardown", WINEVENT_LEVEL_INFO, KA_KW_LIFECYCLE, TraceLoggingFloat64(workerMs, "WorkerMs"),
+             TraceLoggingFloat64(totalMs - workerMs, "CloseMs"));
+    return 0;
 }
 
-static void close_audio(void)
+// --service: state reports to the SCM. Stop/shutdown/power controls are only accepted once the
+// streams are up.
+static void service_report(DWORD state, DWORD exitCode, DWORD waitHint)
 {
-    if (g_hwo)
+    static DWORD checkPoint = 1;
+    SERVICE_STATUS st = {0};
+    st.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+    st.dwCurrentState = state;
+    st.dwControlsAccepted = (state == SERVICE_RUNNING) ? SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_POWEREVENT : 0;
+    st.dwWin32ExitCode = exitCode ? ERROR_SERVICE_SPECIFIC_ERROR : NO_ERROR;
+    st.dwServiceSpecificExitCode = exitCode;
+    st.dwWaitHint = waitHint;
+    st.dwCheckPoint = (state == SERVICE_RUNNING || state == SERVICE_STOPPED) ? 0 : checkPoint++;
+    if (g_serviceHandle)
+        SetServiceStatus(g_serviceHandle, &st);
+}
+
+// Runs on the dispatcher (main) thread while the engine runs on the service thread.
+static DWORD WINAPI service_control(DWORD control, DWORD eventType, LPVOID eventData, LPVOID context)
+{
+    switch (control)
     {
-        waveOutReset(g_hwo);
-        for (int i = 0; i < g_numBuffers; ++i)
-        {
-            int spins = 0;
-            while (!(g_headers[i].dwFlags & WHDR_DONE) && spins++ < 200)
-                Sleep(5);
-            waveOutUnprepareHeader(g_hwo, &g_headers[i], sizeof(WAVEHDR));
-            if (g_buffers && g_buffers[i])
-                HeapFree(GetProcessHeap(), 0, g_buffers[i]);
-        }
-        if (g_buffers)
-            HeapFree(GetProcessHeap(), 0, g_buffers);
-        if (g_headers)
-            HeapFree(GetProcessHeap(), 0, g_headers);
-        g_buffers = NULL;
-        g_headers = NULL;
-        waveOutClose(g_hwo);
-        g_hwo = NULL;
+    case SERVICE_CONTROL_STOP:
+    case SERVICE_CONTROL_SHUTDOWN:
+        service_report(SERVICE_STOP_PENDING, 0, 3000);
+        request_shutdown(control == SERVICE_CONTROL_STOP ? "service stop" : "system shutdown");
+        return NO_ERROR;
+    case SERVICE_CONTROL_POWEREVENT:
+        handle_power_broadcast(eventType, (LPARAM)eventData);
+        return NO_ERROR;
+    case SERVICE_CONTROL_INTERROGATE:
+        return NO_ERROR;
+    default:
+        return ERROR_CALL_NOT_IMPLEMENTED;
     }
 }
 
-static int show_usage(BOOL console)
+static struct
 {
-    const char *txt =
-        "KeepAudio (headless) - keep USB audio interface awake with a near-inaudible tone\n"
-        "Flags:\n"
-        "  --freq F_HZ  --db NEG_DBFS  --rate SR  --device N  --channels 1|2\n"
-        "  --frames N   --buffers K    --format auto|pcm16|float32\n"
-        "  --chance P   --list-devices --install [--install-copy] [--startup-name Name]\n"
-        "  --uninstall  --console\n";
-    if (console)
-        dlog("%s", txt);
-    else
-        MessageBoxA(NULL, txt, "KeepAudio - Help", MB_OK | MB_ICONINFORMATION);
-    return 0;
+    Options *opt;
+    HINSTANCE hInst;
+    int *argc;
+    char ***argv;
+    LPWSTR **argvw;
+} g_serviceRun;
+
+static void WINAPI service_main(DWORD argc, LPWSTR *argv)
+{
+    g_serviceHandle = RegisterServiceCtrlHandlerExW(L"", service_control, NULL);
+    if (!g_serviceHandle)
+        return;
+    service_report(SERVICE_START_PENDING, 0, 10000);
+    int rc = run_engine(g_serviceRun.opt, g_serviceRun.hInst, g_serviceRun.argc, g_serviceRun.argv, g_serviceRun.argvw);
+    release_engine();
+    // A non-zero code counts as a failure, so the SCM's restart actions retry a failed open.
+    service_report(SERVICE_STOPPED, (DWORD)rc, 0);
+}
+
+static void run_service(Options *opt, HINSTANCE hInst, int *argc, char ***argv, LPWSTR **argvw)
+{
+    SERVICE_TABLE_ENTRYW table[] = {{L"", service_main}, {NULL, NULL}};
+    g_asService = TRUE;
+    g_serviceRun.opt = opt;
+    g_serviceRun.hInst = hInst;
+    g_serviceRun.argc = argc;
+    g_serviceRun.argv = argv;
+    g_serviceRun.argvw = argvw;
+    if (!StartServiceCtrlDispatcherW(table))
+        dlog("--service is started by the service manager; use --install-service (%lu)\n", GetLastError());
 }
 
 int APIENTRY WinMain(HINSTANCE hInst, HINSTANCE hPrev, LPSTR lpCmdLine, int nShowCmd)
 {
     int argc = 0;
     LPWSTR *argvw = CommandLineToArgvW(GetCommandLineW(), &argc);
-    char **argv = (char **)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(char *) * (argc > 0 ? argc : 1));
+    char **argv = argvw ? utf8_args(argc, argvw) : NULL;
     if (!argvw || !argv)
         return 1;
-    for (int i = 0; i < argc; ++i)
-    {
-        int len = WideCharToMultiByte(CP_UTF8, 0, argvw[i], -1, NULL, 0, NULL, NULL);
-        argv[i] = (char *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, len);
-        WideCharToMultiByte(CP_UTF8, 0, argvw[i], -1, argv[i], len, NULL, NULL);
-    }
 
     Options opt;
     BOOL listOnly = FALSE;
+    int exitCode = 0;
+    KA_TRACE_REGISTER();
     parse_options(argc, argv, &opt, &listOnly);
 
     if (opt.wantConsole)
@@ -894,6 +6402,10 @@ int APIENTRY WinMain(HINSTANCE hInst, HINSTANCE hPrev, LPSTR lpCmdLine, int nSho
         {
             show_usage(opt.wantConsole);
         }
+        else if (opt.json)
+        {
+            list_devices_json();
+        }
         else
         {
             list_devices_ui(opt.wantConsole);
@@ -912,69 +6424,43 @@ int APIENTRY WinMain(HINSTANCE hInst, HINSTANCE hPrev, LPSTR lpCmdLine, int nSho
         goto cleanup;
     }
 
-    if (opt.chance > 0)
+    if (opt.control[0])
     {
-        rng_seed_from_system();
-        int roll = rng_roll_1_to_100();
-        if (roll <= opt.chance)
-            goto cleanup; // early silent exit
+        send_control(opt.control, opt.wantConsole);
+        goto cleanup;
     }
 
-    // Register hidden window class and create a message-only window.
-    const wchar_t *clsName = L"KeepAudioHiddenClass";
-    WNDCLASSW wc = {0};
-    wc.lpfnWndProc = HiddenWndProc;
-    wc.hInstance = hInst;
-    wc.lpszClassName = clsName;
-    RegisterClassW(&wc);
-    HWND hwnd = CreateWindowExW(0, clsName, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hInst, NULL);
-
-    // Open audio + prime buffers
-    if (!open_audio(&opt))
+    if (opt.soakHours > 0.0)
     {
-        dlog("Audio open failed. Try different --rate/--channels/--device or --format.\n");
+        // No device involved: the exit code is the verdict, for scripts and CI.
+        exitCode = run_soak(&opt);
         goto cleanup;
     }
 
-    // Start audio worker
-    g_audioThread = CreateThread(NULL, 0, AudioThreadProc, NULL, 0, NULL);
-
-    // Pump messages until shutdown/logoff/quit
-    MSG msg;
-    while (InterlockedCompareExchange(&g_running, 1, 1))
+    if (opt.doUninstallService)
     {
-        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
-        {
-            if (msg.message == WM_QUIT)
-                InterlockedExchange(&g_running, 0);
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
-        Sleep(10);
+        uninstall_service(&opt);
+        goto cleanup;
     }
-
-    // Stop thread + audio
-    if (g_audioThread)
+    if (opt.doInstallService)
     {
-        WaitForSingleObject(g_audioThread, 2000);
-        CloseHandle(g_audioThread);
-        g_audioThread = NULL;
+        install_service(argc, argv, &opt);
+        goto cleanup;
     }
-    close_audio();
+
+    if (opt.service)
+        run_service(&opt, hInst, &argc, &argv, &argvw);
+    else
+        run_engine(&opt, hInst, &argc, &argv, &argvw);
 
 cleanup:
+    release_engine();
     if (opt.wantConsole)
     {
         dlog("KeepAudio exiting.\n");
-        Sleep(200);
         FreeConsole();
     }
-    for (int i = 0; i < argc; ++i)
-        if (argv[i])
-            HeapFree(GetProcessHeap(), 0, argv[i]);
-    if (argv)
-        HeapFree(GetProcessHeap(), 0, argv);
-    if (argvw)
-        LocalFree(argvw);
-    return 0;
+    free_args(&argc, &argv, &argvw);
+    KA_TRACE_UNREGISTER();
+    return exitCode;
 }